@@ -0,0 +1,74 @@
+/*
+ * frametable.c keeps the frames found by the indexer in fixed size chunks,
+ * so that the table grows without copying the frames already in it
+ *
+ */
+#include <ffmpeg/avformat.h>
+#include <string.h>
+
+#include "libsjindex/indexer.h"
+#include "frametable.h"
+
+Frame *frame_table_get(FrameTable *t, int pos)
+{
+    int chunk = pos >> FRAME_CHUNK_BITS;
+
+    if (chunk >= t->chunk_num) {
+        // only the chunk pointers are copied
+        int num = FFMAX(2 * t->chunk_num, chunk + 1);
+        Frame **chunks = av_realloc(t->chunks, num * sizeof(*chunks));
+        if (!chunks)
+            return NULL;
+        memset(chunks + t->chunk_num, 0, (num - t->chunk_num) * sizeof(*chunks));
+        t->chunks = chunks;
+        t->chunk_num = num;
+    }
+    if (!t->chunks[chunk]) {
+        if (t->spare_num) {
+            t->chunks[chunk] = t->spare[--t->spare_num];
+        } else {
+            t->chunks[chunk] = av_malloc(FRAME_CHUNK_SIZE * sizeof(Frame));
+            if (!t->chunks[chunk])
+                return NULL;
+            t->size += FRAME_CHUNK_SIZE * sizeof(Frame);
+            t->peak = FFMAX(t->peak, t->size);
+        }
+    }
+    return frame_at(t, pos);
+}
+
+void frame_table_release(FrameTable *t, int pos)
+{
+    int chunk;
+
+    for (chunk = 0; chunk < FFMIN(pos >> FRAME_CHUNK_BITS, t->chunk_num); chunk++) {
+        Frame **spare;
+        if (!t->chunks[chunk])
+            continue;
+        // the spare list never holds more chunks than the table
+        spare = av_realloc(t->spare, (t->spare_num + 1) * sizeof(*spare));
+        if (!spare) {
+            av_free(t->chunks[chunk]);
+            t->size -= FRAME_CHUNK_SIZE * sizeof(Frame);
+        } else {
+            t->spare = spare;
+            t->spare[t->spare_num++] = t->chunks[chunk];
+        }
+        t->chunks[chunk] = NULL;
+    }
+}
+
+void frame_table_free(FrameTable *t)
+{
+    int i;
+
+    for (i = 0; i < t->chunk_num; i++)
+        av_free(t->chunks[i]);
+    for (i = 0; i < t->spare_num; i++)
+        av_free(t->spare[i]);
+    av_free(t->chunks);
+    av_free(t->spare);
+    t->chunks = t->spare = NULL;
+    t->chunk_num = t->spare_num = 0;
+    t->size = 0;
+}
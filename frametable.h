@@ -0,0 +1,53 @@
+#ifndef FRAMETABLE_H
+#define FRAMETABLE_H
+
+#define FRAME_CHUNK_BITS 12
+#define FRAME_CHUNK_SIZE (1 << FRAME_CHUNK_BITS) ///< frames per chunk
+
+/**
+ * Frame as kept by the indexer, the fields are ordered so that there is no padding between them :
+ * 32 bytes instead of the 40 of Index
+ */
+typedef struct {
+    int64_t pts;
+    int64_t dts;
+    offset_t pes_offset;
+    Timecode timecode;
+    uint8_t pic_type;
+} Frame;
+
+/**
+ * Frames in decode order, stored in chunks of FRAME_CHUNK_SIZE frames that are never moved once allocated.
+ * The chunks of the first frames can be released while the following ones are still used,
+ * they are then reused for the next frames.
+ */
+typedef struct {
+    Frame **chunks;         ///< chunk of each run of FRAME_CHUNK_SIZE frames, NULL if not allocated or released
+    int chunk_num;          ///< entries of chunks
+    Frame **spare;          ///< released chunks, reused before allocating new ones
+    int spare_num;
+    int64_t size;           ///< bytes allocated for the chunks
+    int64_t peak;           ///< highest size
+} FrameTable;
+
+static av_always_inline Frame *frame_at(const FrameTable *t, int pos)
+{
+    return &t->chunks[pos >> FRAME_CHUNK_BITS][pos & (FRAME_CHUNK_SIZE - 1)];
+}
+
+/**
+ * Returns the frame at pos, allocating its chunk if needed, or NULL if memory could not be allocated.
+ */
+Frame *frame_table_get(FrameTable *t, int pos);
+
+/**
+ * Releases the chunks holding only frames before pos, those frames can no longer be read.
+ */
+void frame_table_release(FrameTable *t, int pos);
+
+/**
+ * Frees every chunk.
+ */
+void frame_table_free(FrameTable *t);
+
+#endif
@@ -4,15 +4,35 @@
  * its timecode, pts, dts, pes offset and type of encoding (I, P, B)
  *
  */
+#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 #include <ffmpeg/avformat.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <assert.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <dirent.h>
 
 #include "libsjindex/indexer.h"
+#include "libsjindex/sj_index_writer.h"
+#include "psdemux.h"
+#include "startcode.h"
+#include "readahead.h"
+#include "frametable.h"
 
 #define GOP_START_CODE            0x000001b8
 #define PICTURE_START_CODE        0x00000100
+#define PACK_START_CODE           0x000001ba
+#define SEQ_START_CODE            0x000001b3
 
 //#define DEBUG
 
@@ -27,22 +47,136 @@ typedef struct {
 typedef struct {
     AVFormatContext *fc;
     AVStream *video;
-    ByteIOContext opb;
+    SJ_IndexWriter writer;  ///< index file being written
     int need_gop;
     int need_pic;
     int frame_num;
-    Index *index;
+    FrameTable frames;      ///< frames in decode order
     int64_t current_pts;
     int64_t current_dts;
     int frame_duration;
     int64_t start_dts;
     int64_t start_pts;
     Timecode start_timecode;
+    int version; ///< version of the index file to write
+    int pts_pos; ///< first frame whose pts is not resolved yet
+    int pts_next; ///< next I or P frame, its dts is the pts of the one at pts_pos
+    int quiet; ///< only errors are printed, the batch mode reports each file itself
+    char *checkpoint; ///< file the state of a stream indexing is saved to, NULL for none
+    int64_t checkpoint_interval; ///< input bytes between two checkpoints
+    int resume; ///< the stream indexing goes on from the checkpoint
 } StreamContext;
 
 static int idx_sort_by_pts(const void *idx1, const void *idx2)
 {
-    return ((Index *)idx1)->pts - ((Index *)idx2)->pts;
+    int64_t pts1 = ((Frame *)idx1)->pts, pts2 = ((Frame *)idx2)->pts;
+    return (pts1 > pts2) - (pts1 < pts2);
+}
+
+/*
+ * frames are displayed at most a few frames after they are decoded, a small window ordered on pts
+ * is enough to put them in pts order : the frame leaving a full window is the next one displayed
+ */
+typedef struct {
+    Frame idx;
+    int64_t num;            ///< decode order, keeps frames with the same pts in order
+} WindowEntry;
+
+typedef struct {
+    WindowEntry *entries;   ///< binary heap on pts
+    int num;
+    int size;
+    int64_t count;          ///< frames that entered the window
+} ReorderWindow;
+
+static av_always_inline int window_less(const WindowEntry *a, const WindowEntry *b)
+{
+    return a->idx.pts < b->idx.pts || (a->idx.pts == b->idx.pts && a->num < b->num);
+}
+
+static void window_push(ReorderWindow *w, const Frame *idx)
+{
+    WindowEntry e = { *idx, w->count++ };
+    int i = w->num++;
+
+    while (i > 0 && window_less(&e, &w->entries[(i - 1) / 2])) {
+        w->entries[i] = w->entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    w->entries[i] = e;
+}
+
+// removes the frame with the lowest pts from the window and returns it
+static Frame window_pop(ReorderWindow *w)
+{
+    Frame first = w->entries[0].idx;
+    WindowEntry last = w->entries[--w->num];
+    int i = 0;
+
+    while (2 * i + 1 < w->num) {
+        int child = 2 * i + 1;
+        if (child + 1 < w->num && window_less(&w->entries[child + 1], &w->entries[child]))
+            child++;
+        if (!window_less(&w->entries[child], &last))
+            break;
+        w->entries[i] = w->entries[child];
+        i = child;
+    }
+    w->entries[i] = last;
+    return first;
+}
+
+// sorts the frames on pts with qsort, through a contiguous copy of the table
+static void sort_frames(StreamContext *stc)
+{
+    Frame *frames = av_malloc(FFMAX(stc->frame_num, 1) * sizeof(Frame));
+    int i;
+
+    if (!frames) {
+        printf("could not sort the frames\n");
+        return;
+    }
+    for (i = 0; i < stc->frame_num; i += FRAME_CHUNK_SIZE)
+        memcpy(frames + i, frame_at(&stc->frames, i), FFMIN(FRAME_CHUNK_SIZE, stc->frame_num - i) * sizeof(Frame));
+    qsort(frames, stc->frame_num, sizeof(Frame), idx_sort_by_pts);
+    for (i = 0; i < stc->frame_num; i += FRAME_CHUNK_SIZE)
+        memcpy(frame_at(&stc->frames, i), frames + i, FFMIN(FRAME_CHUNK_SIZE, stc->frame_num - i) * sizeof(Frame));
+    av_free(frames);
+}
+
+/*
+ * sorts the frames on pts in a single pass through a window of window_size frames, in place since
+ * a frame leaves the window before the frame at its position enters it. A frame further from its
+ * place than the window is out of order when it leaves, the frames are then sorted again with qsort.
+ */
+static void sort_index(StreamContext *stc, int window_size)
+{
+    ReorderWindow w;
+    int out = 0, sorted = 1;
+    int i;
+
+    memset(&w, 0, sizeof(w));
+    w.size = FFMIN(window_size, stc->frame_num);
+    w.entries = av_malloc(FFMAX(w.size, 1) * sizeof(*w.entries));
+    if (!w.entries) {
+        sort_frames(stc);
+        return;
+    }
+    for (i = 0; i < stc->frame_num || w.num; i++) {
+        if (w.num == w.size || i >= stc->frame_num) {
+            *frame_at(&stc->frames, out) = window_pop(&w);
+            if (out && frame_at(&stc->frames, out)->pts < frame_at(&stc->frames, out - 1)->pts)
+                sorted = 0;
+            out++;
+        }
+        if (i < stc->frame_num)
+            window_push(&w, frame_at(&stc->frames, i));
+    }
+    av_free(w.entries);
+    if (!sorted) {
+        printf("frames reordered further than %d frames, sorting them\n", window_size);
+        sort_frames(stc);
+    }
 }
 
 /*static int idx_sort_by_time(const void *idx1, const void *idx2)
@@ -62,68 +196,88 @@ extern const uint8_t *ff_find_start_code(const uint8_t *p, const uint8_t *end, u
 
 #define PES_SEARCH_LEN 48
 
-static av_always_inline offset_t pes_find_packet_start(ByteIOContext *pb, offset_t from, uint32_t id)
+/*
+ * finds the start code of the PES packet whose payload starts at from, in the bytes the demuxer
+ * still has in its buffer, the input is only read again if the header was flushed out of it.
+ * returns -1 if no PES header of stream id is found.
+ */
+static offset_t pes_find_packet_start(ByteIOContext *pb, offset_t from, uint32_t id)
 {
-    offset_t pos = url_ftell(pb);
+    offset_t buf_start = pb->pos - (pb->buf_end - pb->buffer);
+    offset_t search_start = FFMAX(from - PES_SEARCH_LEN, 0);
+    int len = from - search_start;
     uint8_t buffer[PES_SEARCH_LEN];
+    const uint8_t *p = buffer;
     uint32_t state = -1;
-    offset_t res;
     int i;
 
-    url_fseek(pb, from - PES_SEARCH_LEN, SEEK_SET);
-    get_buffer(pb, buffer, PES_SEARCH_LEN);
-    for (i = 0; i < PES_SEARCH_LEN; i++) {
-        i = ff_find_start_code(buffer + i, buffer + PES_SEARCH_LEN, &state) - buffer - 1;
-        if (state == id) {
-            res = url_ftell(pb) - PES_SEARCH_LEN + i - 3;
-            url_fseek(pb, pos, SEEK_SET);
-            return res;
-        }
+    if (search_start >= buf_start && from <= pb->pos) {
+        p = pb->buffer + (search_start - buf_start);
+    } else {
+        offset_t pos = url_ftell(pb);
+        url_fseek(pb, search_start, SEEK_SET);
+        len = get_buffer(pb, buffer, len);
+        url_fseek(pb, pos, SEEK_SET);
     }
-    abort();
+    for (i = 0; i < len; i++) {
+        i = ff_find_start_code(p + i, p + len, &state) - p - 1;
+        if (state == id)
+            return search_start + i - 3;
+    }
+    return -1;
 }
-static int write_index(StreamContext *stcontext)
+// the start values are written in the header each time it is updated
+static void set_start_values(StreamContext *stc)
 {
-    ByteIOContext indexpb;
-    unsigned int index_size;
-    uint8_t *index_buf;
+    stc->writer.start_pts = stc->start_pts;
+    stc->writer.start_dts = stc->start_dts;
+    stc->writer.start_timecode = stc->start_timecode;
+}
 
-    url_open_dyn_buf(&indexpb);
+static void frame_to_index(const Frame *f, Index *idx)
+{
+    idx->pic_type = f->pic_type;
+    idx->pts = f->pts;
+    idx->dts = f->dts;
+    idx->pes_offset = f->pes_offset;
+    idx->timecode = f->timecode;
+}
+
+static void get_index(void *opaque, int pos, Index *idx)
+{
+    frame_to_index(frame_at(opaque, pos), idx);
+}
+
+/*
+ * version 1 writes each field as a column, versions 0, 2 and 3 a record per frame,
+ * the index file is complete once the writer is closed
+ */
+static int write_index(StreamContext *stcontext, int window)
+{
+    SJ_IndexWriter *w = &stcontext->writer;
+    Index idx;
     int i;
 
-    qsort(stcontext->index, stcontext->frame_num, sizeof(Index), idx_sort_by_pts);
-    put_le64(&indexpb, 0x534A2D494E444558LL);       // Magic number : SJ-INDEX in hex
-    put_byte(&indexpb, 0x00000000);                 // Version
-    put_le64(&indexpb, stcontext->start_pts);                 // PTS of the first frame to be displayed
-    put_le64(&indexpb, stcontext->start_dts);                 // DTS of the first frame to be decoded
-    put_byte(&indexpb, stcontext->start_timecode.frames);     // Frame component of first diplayed frame's timecode
-    put_byte(&indexpb, stcontext->start_timecode.seconds);    // Seconds component of first diplayed frame's timecode
-    put_byte(&indexpb, stcontext->start_timecode.minutes);    // Minutes component of first diplayed frame's timecode
-    put_byte(&indexpb, stcontext->start_timecode.hours);      // Hours component of first diplayed frame's timecode
-    for (i = 0; i < stcontext->frame_num; i++) {
-        Index *idx = &stcontext->index[i];
-        put_le64(&indexpb, idx->pts);               // PTS
-        put_le64(&indexpb, idx->dts);               // DTS
-        put_le64(&indexpb, idx->pes_offset);        // PES offset
-        put_byte(&indexpb, idx->pic_type);          // Picture Type
-        put_byte(&indexpb, idx->timecode.frames);   // Frame number in timecode
-        put_byte(&indexpb, idx->timecode.seconds);  // Seconds number in timecode
-        put_byte(&indexpb, idx->timecode.minutes);  // Minutes number in timecode
-        put_byte(&indexpb, idx->timecode.hours);    // Hours number in timecode
-        put_flush_packet(&indexpb);
-    }
-    index_size = url_close_dyn_buf(&indexpb, &index_buf);
-    put_flush_packet(&indexpb);
-    printf("index size %d\n", index_size);
-    put_buffer(&stcontext->opb, index_buf, index_size);
-    put_flush_packet(&stcontext->opb);
-    return 0;
+    sort_index(stcontext, window);
+    if (stcontext->version == 1) {
+        if (sj_index_writer_columns(w, stcontext->frame_num, get_index, &stcontext->frames) < 0)
+            return -1;
+    } else {
+        for (i = 0; i < stcontext->frame_num; i++) {
+            frame_to_index(frame_at(&stcontext->frames, i), &idx);
+            if (sj_index_writer_add(w, &idx) < 0)
+                return -1;
+        }
+    }
+    printf("index size %lld\n", w->offset + w->buf_len);
+    set_start_values(stcontext);
+    return sj_index_writer_close(w);
 }
 
 
-static av_always_inline int idx_set_timestamps(StreamContext *stc, Index *idx, AVPacket *pkt, AVStream *st)
+static av_always_inline int idx_set_timestamps(StreamContext *stc, Frame *idx, AVPacket *pkt, AVStream *st)
 {
-    Index *oldidx = stc->frame_num ? &stc->index[stc->frame_num - 1] : NULL;
+    Frame *oldidx = stc->frame_num ? frame_at(&stc->frames, stc->frame_num - 1) : NULL;
     idx->dts = stc->current_dts;
     idx->pts = stc->current_pts;
     if (oldidx){
@@ -144,7 +298,7 @@ static int check_timecode_presence(TimeContext *tc)
     }
     return 0;
 }
-static int parse_gop_timecode(Index *idx, TimeContext *tc, uint8_t *buf)
+static int parse_gop_timecode(Frame *idx, TimeContext *tc, uint8_t *buf)
 {
     tc->drop_mode = !!(buf[0] & 0x80);
     tc->gop_time.hours   = idx->timecode.hours   = (buf[0] >> 2) & 0x1f;
@@ -156,7 +310,7 @@ static int parse_gop_timecode(Index *idx, TimeContext *tc, uint8_t *buf)
     return 0;
 }
 
-static av_always_inline int adjust_timecode(Index *idx, TimeContext *tc)
+static av_always_inline int adjust_timecode(Frame *idx, TimeContext *tc)
 {
     while (idx->timecode.frames >= tc->fps) {
         idx->timecode.seconds++;
@@ -178,7 +332,7 @@ static av_always_inline int adjust_timecode(Index *idx, TimeContext *tc)
     return 0;
 }
 
-static int parse_pic_timecode(Index *idx, TimeContext *tc, Index *last_in_gop, uint8_t *buf)
+static int parse_pic_timecode(Frame *idx, TimeContext *tc, Frame *last_in_gop, uint8_t *buf)
 {
     int temp_ref = (buf[0] << 2) | (buf[1] >> 6);
     idx->pic_type = (buf[1] >> 3) & 0x07;
@@ -203,60 +357,1492 @@ static int parse_pic_timecode(Index *idx, TimeContext *tc, Index *last_in_gop, u
     return 0;
 }
 
-static int calculate_pts_from_dts(StreamContext *stc)
+/*
+ * gives the I and P frames the dts of the next I or P frame as pts, for the frames before limit.
+ * the progress is kept in pts_pos and pts_next so that it can go on as frames are added.
+ */
+static int resolve_pts(StreamContext *stc, int limit)
 {
-    int i = 0, j = 1;
-    while (i < stc->frame_num && j < stc->frame_num) {
-        if (stc->index[i].pic_type != 3 && stc->index[j].pic_type != 3) {
-            stc->index[i].pts = stc->index[j].dts;
-            stc->start_pts = FFMIN(stc->start_pts, stc->index[i].pts);
-            stc->start_timecode = timecode_min(stc->start_timecode, stc->index[i].timecode);
+    int i = stc->pts_pos, j = stc->pts_next;
+    while (i < limit && j < limit) {
+        if (frame_at(&stc->frames, i)->pic_type != 3 && frame_at(&stc->frames, j)->pic_type != 3) {
+            frame_at(&stc->frames, i)->pts = frame_at(&stc->frames, j)->dts;
+            stc->start_pts = FFMIN(stc->start_pts, frame_at(&stc->frames, i)->pts);
+            stc->start_timecode = timecode_min(stc->start_timecode, frame_at(&stc->frames, i)->timecode);
             i++;
             j++;
         }
-        while (i < stc->frame_num && stc->index[i].pic_type == 3) {
-            stc->start_pts = FFMIN(stc->start_pts, stc->index[i].pts);
-            stc->start_timecode = timecode_min(stc->start_timecode, stc->index[i].timecode);
+        while (i < limit && frame_at(&stc->frames, i)->pic_type == 3) {
+            stc->start_pts = FFMIN(stc->start_pts, frame_at(&stc->frames, i)->pts);
+            stc->start_timecode = timecode_min(stc->start_timecode, frame_at(&stc->frames, i)->timecode);
             i++;
         }
-        while (j < stc->frame_num && stc->index[j].pic_type == 3) {
+        while (j < limit && frame_at(&stc->frames, j)->pic_type == 3) {
             j++;
         }
     }
+    stc->pts_pos = i;
+    stc->pts_next = j;
+    return 0;
+}
+
+static int calculate_pts_from_dts(StreamContext *stc)
+{
+    int i;
+
+    resolve_pts(stc, stc->frame_num);
+    i = stc->pts_pos;
     // the last I frame will not get a pts from another frame's dts unless its pts was the transport's package pts
     // in other words if the last I frame's pts is equal to the one just before then it needs to be incremented
-    if (stc->index[i].pts == stc->index[i - 1].pts) {
-        stc->index[i].pts += stc->frame_duration;
+    if (i > 0 && i < stc->frame_num && frame_at(&stc->frames, i)->pts == frame_at(&stc->frames, i - 1)->pts) {
+        frame_at(&stc->frames, i)->pts += stc->frame_duration;
+    }
+    return 0;
+}
+
+static const int frame_rates[16] = { 0, 24, 24, 25, 30, 30, 50, 60, 60 };
+
+static void set_frame_rate(StreamContext *stc, TimeContext *tc, int fps)
+{
+    tc->fps = fps;
+    stc->frame_duration = av_rescale(1, 90000, tc->fps);
+    stc->start_timecode.frames = tc->fps - 1;
+}
+
+/*
+ * the input is scanned for start codes first, possibly by several threads over distinct byte ranges,
+ * then the events are replayed in stream order to compute the timecodes and timestamps
+ */
+enum { GOP_EVENT, PIC_EVENT, SEQ_EVENT };
+
+// header bytes kept after each start code
+static av_always_inline int event_size(int type)
+{
+    return type == PIC_EVENT ? 2 : 4;
+}
+
+typedef struct {
+    uint8_t type;
+    uint8_t split;          ///< the header was completed from the next packet
+    uint8_t data[4];        ///< bytes following the start code
+    uint8_t has_ts;         ///< a timestamp was seen in the range up to this event
+    offset_t pes_offset;    ///< offset of the PES packet where the picture start code begins
+    int64_t dts;            ///< last dts seen in the range when the picture start code was found
+    int64_t pts;
+} ScanEvent;
+
+typedef struct ScanRange {
+    AVFormatContext *ic;    ///< demuxer context, NULL when the range is demuxed in place by ps
+    PSDemux ps;
+    ReadAhead ra;           ///< buffers parsed by ps, unused if the whole input is mapped
+    int fd;
+    AVPacket avpkt;         ///< packet read by ic, released on the next read
+    int has_avpkt;
+    int video_id;           ///< 0 to pick the first video stream found by ps
+    offset_t start;         ///< offset of the first pack of the range
+    offset_t end;           ///< offset of the first pack of the next range
+    ScanEvent *events;
+    int event_num;
+    int event_size;
+    int has_ts;             ///< a timestamp was seen in the range
+    int64_t last_dts;       ///< last timestamps seen in the range
+    int64_t last_pts;
+    int64_t first_dts;      ///< first non zero dts seen in the range
+    uint32_t state;         ///< start code search state, -1 at the start of the input
+    offset_t last_pkt_offset; ///< offset of the previous packet, a picture start code can begin in it
+    int gop;                ///< the last packet scanned holds a GOP header
+    offset_t checkpoint;    ///< offset from which a packet holding a GOP header is followed by a flush
+    int error;
+    int (*flush)(struct ScanRange *r); ///< consumes the events while scanning, NULL to keep them all
+    int (*idle)(struct ScanRange *r);  ///< called when a followed input stops growing, returns 1 to end the scan
+    void *opaque;
+} ScanRange;
+
+#define FLUSH_EVENTS 4096
+
+static ScanEvent *add_event(ScanRange *r, int type)
+{
+    ScanEvent *e;
+
+    if (r->event_num == r->event_size) {
+        int size = r->event_size ? 2 * r->event_size : 1024;
+        e = av_realloc(r->events, size * sizeof(*e));
+        if (!e)
+            return NULL;
+        r->events = e;
+        r->event_size = size;
+    }
+    e = &r->events[r->event_num++];
+    memset(e, 0, sizeof(*e));
+    e->type = type;
+    return e;
+}
+
+/*
+ * reads the next packet of the video stream, from the mapped input or through libavformat
+ * returns 0 at the end of the input, -1 when a followed input has no new data yet
+ */
+static int read_video_packet(ScanRange *r, PSPacket *pkt)
+{
+    if (!r->ic) {
+        while (1) {
+            const uint8_t *data;
+            offset_t offset;
+            int size;
+
+            if (!ps_read_packet(&r->ps, pkt)) {
+                if (!r->video_id && pkt->stream_id >= 0x1e0 && pkt->stream_id <= 0x1ef)
+                    r->video_id = pkt->stream_id;
+                if (pkt->stream_id == r->video_id)
+                    return 1;
+                continue;
+            }
+            if (!r->ra.started)
+                return 0;
+            // the packet continues in the next buffer
+            data = read_ahead_next(&r->ra, r->ps.ptr, r->ps.end - r->ps.ptr, &size, &offset);
+            if (!data) {
+                if (r->ra.error < 0) {
+                    printf("error reading input at offset %lld\n", r->ra.offset);
+                    r->error = r->ra.error;
+                } else if (r->ra.follow) {
+                    // the held buffer stays valid, the packet is completed on the next call
+                    return -1;
+                }
+                return 0;
+            }
+            ps_demux_init(&r->ps, data, size, offset);
+        }
+    }
+
+    if (r->has_avpkt)
+        av_free_packet(&r->avpkt);
+    r->has_avpkt = 0;
+    while (av_read_packet(r->ic, &r->avpkt) >= 0) {
+        AVStream *st = r->ic->streams[r->avpkt.stream_index];
+        if (st->id != r->video_id) {
+            av_free_packet(&r->avpkt);
+            continue;
+        }
+        r->has_avpkt = 1;
+        pkt->data = r->avpkt.data;
+        pkt->size = r->avpkt.size;
+        pkt->stream_id = st->id;
+        pkt->pts = r->avpkt.pts;
+        pkt->dts = r->avpkt.dts;
+        pkt->pes_offset = pes_find_packet_start(&r->ic->pb, url_ftell(&r->ic->pb) - pkt->size, st->id);
+        if (pkt->pes_offset < 0) {
+            printf("PES header not found before offset %lld\n", url_ftell(&r->ic->pb) - pkt->size);
+            r->error = AVERROR(EINVAL);
+            return 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * scans the video packets starting in [start, end[ for GOP and picture start codes.
+ * once past end, start codes begun in the range and headers split over the seam are completed
+ * from the following packets, the start codes of the next range are left to it.
+ */
+static void *scan_range(void *arg)
+{
+    ScanRange *r = arg;
+    PSPacket pkt;
+    uint32_t state = r->state;
+    offset_t last_pkt_offset = r->last_pkt_offset;
+    int need = 0, pending = -1; // header bytes missing from event pending
+    int past_end = 0;
+    int i, ret;
+
+    while ((ret = read_video_packet(r, &pkt))) {
+        if (ret < 0) {
+            // the input is not growing, the events so far are consumed before waiting for more
+            if (!need && r->event_num) {
+                r->state = state;
+                r->last_pkt_offset = last_pkt_offset;
+                r->gop = 0;
+                if ((r->error = r->flush(r)) < 0)
+                    break;
+                r->event_num = 0;
+            }
+            if ((ret = r->idle(r))) {
+                if (ret < 0)
+                    r->error = ret;
+                break;
+            }
+            continue;
+        }
+//      records the offset of the packet in case the next picture start code begins in it and finishes in the next packet
+        offset_t pkt_offset = pkt.pes_offset;
+        // after the end, only start codes that began in the range are looked for
+        int limit = pkt.size;
+        if (pkt_offset >= r->end)
+            limit = past_end++ ? 0 : FFMIN(pkt.size, 3);
+
+        // the first packet past the end still times a picture start code begun in the range
+        if ((!past_end || limit) && pkt.dts != AV_NOPTS_VALUE) {
+            r->has_ts = 1;
+            r->last_dts = pkt.dts;
+            r->last_pts = pkt.pts;
+            if (!r->first_dts)
+                r->first_dts = pkt.dts;
+        }
+        r->gop = 0;
+        if (need) {
+            ScanEvent *e = &r->events[pending];
+            int size = event_size(e->type);
+            memcpy(e->data + size - need, pkt.data, FFMIN(need, pkt.size));
+            e->split = 1;
+            need = 0;
+        }
+        for (i = 0; i < limit; i++) {
+            i = find_start_code(pkt.data + i, pkt.data + pkt.size, &state) - pkt.data - 1;
+            if (i >= limit)
+                break;
+            if (state == GOP_START_CODE || state == PICTURE_START_CODE || state == SEQ_START_CODE) {
+                int type = state == GOP_START_CODE ? GOP_EVENT : state == PICTURE_START_CODE ? PIC_EVENT : SEQ_EVENT;
+                int size = event_size(type);
+                int bytes = FFMIN(pkt.size - i - 1, size);
+                ScanEvent *e = add_event(r, type);
+                if (!e) {
+                    r->error = AVERROR(ENOMEM);
+                    break;
+                }
+                memcpy(e->data, pkt.data + i + 1, bytes);
+                need = size - bytes;
+                pending = r->event_num - 1;
+                if (e->type == GOP_EVENT)
+                    r->gop = 1;
+                if (e->type == PIC_EVENT) {
+                    // check if startcode begins in last packet
+                    e->pes_offset = i < 3 ? last_pkt_offset : pkt_offset;
+                    e->has_ts = r->has_ts;
+                    e->dts = r->last_dts;
+                    e->pts = r->last_pts;
+                }
+            }
+        }
+        last_pkt_offset = pkt_offset;
+        if (r->error < 0 || (past_end && !need))
+            break;
+        // a checkpoint is taken after the packet starting a GOP
+        if (r->flush && !need && (r->event_num >= FLUSH_EVENTS || (r->gop && pkt_offset >= r->checkpoint))) {
+            r->state = state;
+            r->last_pkt_offset = last_pkt_offset;
+            if ((r->error = r->flush(r)) < 0)
+                break;
+            r->event_num = 0;
+        }
+    }
+    if (r->has_avpkt)
+        av_free_packet(&r->avpkt);
+    r->has_avpkt = 0;
+    return NULL;
+}
+
+/*
+ * replays the events of a range, in stream order, as the sequential parser would
+ */
+static int replay_range(StreamContext *stc, TimeContext *tc, ScanRange *r, int *count_gop, int *last_in_gop)
+{
+    Frame scratch;
+    int i;
+
+    for (i = 0; i < r->event_num; i++) {
+        ScanEvent *e = &r->events[i];
+        if (e->type == GOP_EVENT) {
+            (*count_gop)++;
+            *last_in_gop = stc->frame_num - 1;
+            if (e->split) {
+                // a split GOP header is parsed into the last picture, as it was when the next packet came
+                if (!tc->timecode_generate)
+                    parse_gop_timecode(stc->frame_num ? frame_at(&stc->frames, stc->frame_num - 1) : &scratch, tc, e->data);
+                if (*count_gop == 2)
+                    check_timecode_presence(tc);
+            } else if (!tc->timecode_generate) {
+                parse_gop_timecode(&scratch, tc, e->data);
+                if (*count_gop == 2)
+                    check_timecode_presence(tc);
+            }
+        } else if (e->type == SEQ_EVENT) {
+            // the frame rate is read from the stream when it was not probed
+            if (!tc->fps && frame_rates[e->data[3] & 0x0f])
+                set_frame_rate(stc, tc, frame_rates[e->data[3] & 0x0f]);
+        } else if (tc->fps) {
+            Frame *idx = frame_table_get(&stc->frames, stc->frame_num);
+            if (!idx)
+                return AVERROR(ENOMEM);
+            if (e->has_ts) {
+                stc->current_dts = e->dts;
+                stc->current_pts = e->pts;
+            }
+            idx->pes_offset = e->pes_offset;
+            parse_pic_timecode(idx, tc, *last_in_gop >= 0 ? frame_at(&stc->frames, *last_in_gop) : &scratch, e->data);
+            assert(idx->pic_type > 0 && idx->pic_type < 4);
+            idx_set_timestamps(stc, idx, NULL, NULL);
+            stc->frame_num++;
+        }
+    }
+    if (r->has_ts) {
+        stc->current_dts = r->last_dts;
+        stc->current_pts = r->last_pts;
+    }
+    if (!stc->start_dts)
+        stc->start_dts = r->first_dts;
+    return 0;
+}
+
+/*
+ * stream mode : the events are replayed while scanning, frames whose pts is resolved go through
+ * a window ordered on pts and are written as they leave it, only the frames still needed are kept
+ */
+typedef struct {
+    StreamContext *stc;
+    TimeContext *tc;
+    int count_gop;
+    int last_in_gop;
+    int pushed;             ///< frames of stc->frames already in the window
+    ReorderWindow window;
+    int64_t written;        ///< records written
+    int64_t published;      ///< records counted in the header
+    int follow;             ///< seconds a followed input can stay idle before it is considered complete
+} StreamOutput;
+
+// writes the frame with the lowest pts and removes it from the window
+static void stream_pop(StreamOutput *so)
+{
+    Frame f = window_pop(&so->window);
+    Index idx;
+
+    frame_to_index(&f, &idx);
+    // a write error is reported by the next publish
+    sj_index_writer_add(&so->stc->writer, &idx);
+    so->written++;
+}
+
+// moves the frames before resolved to the window and releases the chunks of the frames no longer needed
+static void stream_output(StreamOutput *so, int resolved)
+{
+    StreamContext *stc = so->stc;
+    int keep;
+
+    for (; so->pushed < resolved; so->pushed++) {
+        if (so->window.num == so->window.size)
+            stream_pop(so);
+        window_push(&so->window, frame_at(&stc->frames, so->pushed));
+    }
+
+    // the previous frame, the last frame of the previous GOP and the frames before the pts resolution are kept
+    keep = FFMIN(so->pushed, FFMIN(stc->frame_num, stc->pts_pos) - 1);
+    if (so->last_in_gop >= 0)
+        keep = FFMIN(keep, so->last_in_gop);
+    if (keep > 0)
+        frame_table_release(&stc->frames, keep);
+}
+
+/*
+ * writes the frames of the window that no frame to come can precede : the next frames have a dts,
+ * and so a pts, above the last dts, the frames not in the window yet keep their own pts
+ */
+static void stream_release(StreamOutput *so)
+{
+    StreamContext *stc = so->stc;
+    int64_t limit;
+    int i;
+
+    if (!stc->frame_num)
+        return;
+    limit = frame_at(&stc->frames, stc->frame_num - 1)->dts;
+    for (i = so->pushed; i < stc->frame_num; i++)
+        limit = FFMIN(limit, frame_at(&stc->frames, i)->pts);
+    while (so->window.num && so->window.entries[0].idx.pts <= limit)
+        stream_pop(so);
+}
+
+// makes the records written so far visible to the readers of the index file
+static int stream_publish(StreamOutput *so)
+{
+    set_start_values(so->stc);
+    if (sj_index_writer_publish(&so->stc->writer) < 0) {
+        printf("error writing index\n");
+        return AVERROR(EIO);
+    }
+    so->published = so->written;
+    return 0;
+}
+
+#define CHECKPOINT_MAGIC "SJ-CKPT2" // the last character is the version of the layout
+
+/*
+ * state of a stream indexing saved once its records are on disk, followed by the frames still
+ * needed from first_frame on, the frames of the window and the block directory of a version 3 index
+ */
+typedef struct {
+    dev_t dev;                  ///< input file
+    ino_t ino;
+    offset_t offset;            ///< input offset the scan goes on from
+    uint32_t state;
+    offset_t last_pkt_offset;
+    int has_ts;
+    int64_t last_dts;
+    int64_t last_pts;
+    int64_t first_dts;
+    TimeContext tc;
+    int frame_num;
+    int64_t current_pts;
+    int64_t current_dts;
+    int frame_duration;
+    int64_t start_dts;
+    int64_t start_pts;
+    Timecode start_timecode;
+    int pts_pos;
+    int pts_next;
+    int first_frame;
+    int count_gop;
+    int last_in_gop;
+    int pushed;
+    int window_num;
+    int window_size;
+    int64_t window_count;
+    int64_t written;
+    SJ_IndexWriterMark mark;
+    char filename[PATH_MAX];    ///< index file
+    char tmpname[PATH_MAX];     ///< temporary file being written, empty if the index is written in place
+} Checkpoint;
+
+/*
+ * a checkpoint is written and read by the same functions, field by field,
+ * little endian whatever the host as the index files
+ */
+typedef struct {
+    FILE *f;
+    int write;
+    int error;                  ///< set once a field could not be read or written
+} CheckpointFile;
+
+// a value of bytes bytes, sign extended when read
+static int64_t checkpoint_value(CheckpointFile *cf, int64_t v, int bytes)
+{
+    uint64_t u = 0;
+    int i, c;
+
+    if (cf->write) {
+        for (i = 0; i < bytes; i++) {
+            if (putc((uint64_t)v >> 8 * i & 0xff, cf->f) == EOF)
+                cf->error = 1;
+        }
+        return v;
+    }
+    for (i = 0; i < bytes; i++) {
+        if ((c = getc(cf->f)) == EOF)
+            cf->error = 1;
+        u |= (uint64_t)(c & 0xff) << 8 * i;
+    }
+    if (bytes < 8 && u >> (8 * bytes - 1))
+        u |= ~0ULL << 8 * bytes;
+    return u;
+}
+
+#define CHECKPOINT_FIELD(cf, field, bytes) ((field) = checkpoint_value(cf, field, bytes))
+
+static void checkpoint_timecode(CheckpointFile *cf, Timecode *tc)
+{
+    CHECKPOINT_FIELD(cf, tc->hours, 1);
+    CHECKPOINT_FIELD(cf, tc->minutes, 1);
+    CHECKPOINT_FIELD(cf, tc->seconds, 1);
+    CHECKPOINT_FIELD(cf, tc->frames, 1);
+}
+
+static void checkpoint_frame(CheckpointFile *cf, Frame *frame)
+{
+    CHECKPOINT_FIELD(cf, frame->pts, 8);
+    CHECKPOINT_FIELD(cf, frame->dts, 8);
+    CHECKPOINT_FIELD(cf, frame->pes_offset, 8);
+    checkpoint_timecode(cf, &frame->timecode);
+    CHECKPOINT_FIELD(cf, frame->pic_type, 1);
+}
+
+// a file name, its length first
+static void checkpoint_name(CheckpointFile *cf, char *name)
+{
+    int len = cf->write ? strlen(name) : 0;
+
+    CHECKPOINT_FIELD(cf, len, 4);
+    if (len < 0 || len >= PATH_MAX) {
+        cf->error = 1;
+        return;
+    }
+    if (cf->write ? fwrite(name, 1, len, cf->f) != len : fread(name, 1, len, cf->f) != len)
+        cf->error = 1;
+    name[len] = 0;
+}
+
+// the header and the state, returns 0 or -1 on error
+static int checkpoint_state(CheckpointFile *cf, Checkpoint *c)
+{
+    char magic[8];
+
+    if (cf->write ? fwrite(CHECKPOINT_MAGIC, 1, 8, cf->f) != 8 :
+        fread(magic, 1, 8, cf->f) != 8 || memcmp(magic, CHECKPOINT_MAGIC, 8))
+        return -1;
+    CHECKPOINT_FIELD(cf, c->dev, 8);
+    CHECKPOINT_FIELD(cf, c->ino, 8);
+    CHECKPOINT_FIELD(cf, c->offset, 8);
+    CHECKPOINT_FIELD(cf, c->state, 4);
+    CHECKPOINT_FIELD(cf, c->last_pkt_offset, 8);
+    CHECKPOINT_FIELD(cf, c->has_ts, 4);
+    CHECKPOINT_FIELD(cf, c->last_dts, 8);
+    CHECKPOINT_FIELD(cf, c->last_pts, 8);
+    CHECKPOINT_FIELD(cf, c->first_dts, 8);
+    checkpoint_timecode(cf, &c->tc.gop_time);
+    CHECKPOINT_FIELD(cf, c->tc.gop_num, 4);
+    CHECKPOINT_FIELD(cf, c->tc.fps, 4);
+    CHECKPOINT_FIELD(cf, c->tc.drop_mode, 1);
+    CHECKPOINT_FIELD(cf, c->tc.timecode_generate, 4);
+    CHECKPOINT_FIELD(cf, c->frame_num, 4);
+    CHECKPOINT_FIELD(cf, c->current_pts, 8);
+    CHECKPOINT_FIELD(cf, c->current_dts, 8);
+    CHECKPOINT_FIELD(cf, c->frame_duration, 4);
+    CHECKPOINT_FIELD(cf, c->start_dts, 8);
+    CHECKPOINT_FIELD(cf, c->start_pts, 8);
+    checkpoint_timecode(cf, &c->start_timecode);
+    CHECKPOINT_FIELD(cf, c->pts_pos, 4);
+    CHECKPOINT_FIELD(cf, c->pts_next, 4);
+    CHECKPOINT_FIELD(cf, c->first_frame, 4);
+    CHECKPOINT_FIELD(cf, c->count_gop, 4);
+    CHECKPOINT_FIELD(cf, c->last_in_gop, 4);
+    CHECKPOINT_FIELD(cf, c->pushed, 4);
+    CHECKPOINT_FIELD(cf, c->window_num, 4);
+    CHECKPOINT_FIELD(cf, c->window_size, 4);
+    CHECKPOINT_FIELD(cf, c->window_count, 8);
+    CHECKPOINT_FIELD(cf, c->written, 8);
+    CHECKPOINT_FIELD(cf, c->mark.version, 4);
+    CHECKPOINT_FIELD(cf, c->mark.offset, 8);
+    CHECKPOINT_FIELD(cf, c->mark.count, 8);
+    CHECKPOINT_FIELD(cf, c->mark.dir_len, 4);
+    CHECKPOINT_FIELD(cf, c->mark.last.pic_type, 1);
+    CHECKPOINT_FIELD(cf, c->mark.last.pts, 8);
+    CHECKPOINT_FIELD(cf, c->mark.last.dts, 8);
+    CHECKPOINT_FIELD(cf, c->mark.last.pes_offset, 8);
+    checkpoint_timecode(cf, &c->mark.last.timecode);
+    CHECKPOINT_FIELD(cf, c->mark.last_step, 8);
+    checkpoint_name(cf, c->filename);
+    checkpoint_name(cf, c->tmpname);
+    return cf->error ? -1 : 0;
+}
+
+/*
+ * saves the state of the indexing after the packets scanned so far, the records written are synced first
+ * and the checkpoint replaced at once, so that an interruption at any time leaves a checkpoint to resume from
+ */
+static int stream_checkpoint(ScanRange *r, StreamOutput *so)
+{
+    StreamContext *stc = so->stc;
+    Checkpoint *c = av_mallocz(sizeof(*c));
+    CheckpointFile cf = { NULL, 1, 0 };
+    char tmpname[PATH_MAX];
+    struct stat st;
+    int ret = AVERROR(EIO);
+    int i;
+
+    if (!c)
+        return AVERROR(ENOMEM);
+    set_start_values(stc);
+    if (fstat(r->ra.fd, &st) < 0 || sj_index_writer_sync(&stc->writer, &c->mark) < 0)
+        goto end;
+    so->published = so->written;
+
+    c->dev = st.st_dev;
+    c->ino = st.st_ino;
+    c->offset = r->ps.offset + (r->ps.ptr - r->ps.buf);
+    c->state = r->state;
+    c->last_pkt_offset = r->last_pkt_offset;
+    c->has_ts = r->has_ts;
+    c->last_dts = r->last_dts;
+    c->last_pts = r->last_pts;
+    c->first_dts = r->first_dts;
+    c->tc = *so->tc;
+    c->frame_num = stc->frame_num;
+    c->current_pts = stc->current_pts;
+    c->current_dts = stc->current_dts;
+    c->frame_duration = stc->frame_duration;
+    c->start_dts = stc->start_dts;
+    c->start_pts = stc->start_pts;
+    c->start_timecode = stc->start_timecode;
+    c->pts_pos = stc->pts_pos;
+    c->pts_next = stc->pts_next;
+    // the frames stream_output keeps
+    c->first_frame = FFMIN(so->pushed, FFMIN(stc->frame_num, stc->pts_pos) - 1);
+    if (so->last_in_gop >= 0)
+        c->first_frame = FFMIN(c->first_frame, so->last_in_gop);
+    c->first_frame = FFMAX(c->first_frame, 0);
+    c->count_gop = so->count_gop;
+    c->last_in_gop = so->last_in_gop;
+    c->pushed = so->pushed;
+    c->window_num = so->window.num;
+    c->window_size = so->window.size;
+    c->window_count = so->window.count;
+    c->written = so->written;
+    snprintf(c->filename, sizeof(c->filename), "%s", stc->writer.filename);
+    if (stc->writer.tmpname)
+        snprintf(c->tmpname, sizeof(c->tmpname), "%s", stc->writer.tmpname);
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", stc->checkpoint);
+    if (!(cf.f = fopen(tmpname, "w")) || checkpoint_state(&cf, c) < 0)
+        goto end;
+    for (i = c->first_frame; i < c->frame_num; i++)
+        checkpoint_frame(&cf, frame_at(&stc->frames, i));
+    for (i = 0; i < so->window.num; i++) {
+        checkpoint_frame(&cf, &so->window.entries[i].idx);
+        CHECKPOINT_FIELD(&cf, so->window.entries[i].num, 8);
+    }
+    // the directory is already little endian
+    if (cf.error || (c->mark.dir_len && fwrite(stc->writer.dir, 1, c->mark.dir_len, cf.f) != c->mark.dir_len) ||
+        fflush(cf.f) || fsync(fileno(cf.f)) < 0)
+        goto end;
+    ret = 0;
+end:
+    if (cf.f && fclose(cf.f) && !ret)
+        ret = AVERROR(EIO);
+    if (!ret && rename(tmpname, stc->checkpoint) < 0)
+        ret = AVERROR(EIO);
+    if (ret < 0) {
+        printf("error writing checkpoint: %s\n", stc->checkpoint);
+        if (cf.f)
+            unlink(tmpname);
     }
+    av_free(c);
+    return ret;
+}
+
+/*
+ * restores the state saved by stream_checkpoint, the index being written is reopened and cut back
+ * to the records written then. Returns the input offset to go on from or a negative error code.
+ */
+static offset_t stream_resume(ScanRange *r, StreamOutput *so, int fd)
+{
+    StreamContext *stc = so->stc;
+    Checkpoint *c = av_malloc(sizeof(*c));
+    CheckpointFile cf = { NULL, 0, 0 };
+    uint8_t *dir = NULL;
+    WindowEntry *entries;
+    struct stat st;
+    offset_t ret = AVERROR(EINVAL);
+    int i;
+
+    if (!c)
+        return AVERROR(ENOMEM);
+    if (!(cf.f = fopen(stc->checkpoint, "r")) || checkpoint_state(&cf, c) < 0 ||
+        c->first_frame < 0 || c->first_frame > c->frame_num || c->window_num < 0 || c->window_num > c->window_size ||
+        c->mark.dir_len < 0) {
+        printf("invalid checkpoint: %s\n", stc->checkpoint);
+        goto end;
+    }
+    if (fstat(fd, &st) < 0 || st.st_dev != c->dev || st.st_ino != c->ino || st.st_size < c->offset) {
+        printf("checkpoint %s is not one of this input\n", stc->checkpoint);
+        goto end;
+    }
+    if (c->mark.version != stc->version) {
+        printf("checkpoint %s is one of a version %d index\n", stc->checkpoint, c->mark.version);
+        goto end;
+    }
+
+    r->state = c->state;
+    r->last_pkt_offset = c->last_pkt_offset;
+    r->has_ts = c->has_ts;
+    r->last_dts = c->last_dts;
+    r->last_pts = c->last_pts;
+    r->first_dts = c->first_dts;
+    *so->tc = c->tc;
+    stc->frame_num = c->frame_num;
+    stc->current_pts = c->current_pts;
+    stc->current_dts = c->current_dts;
+    stc->frame_duration = c->frame_duration;
+    stc->start_dts = c->start_dts;
+    stc->start_pts = c->start_pts;
+    stc->start_timecode = c->start_timecode;
+    stc->pts_pos = c->pts_pos;
+    stc->pts_next = c->pts_next;
+    so->count_gop = c->count_gop;
+    so->last_in_gop = c->last_in_gop;
+    so->pushed = c->pushed;
+    so->written = so->published = c->written;
+
+    for (i = c->first_frame; i < c->frame_num; i++) {
+        Frame *frame = frame_table_get(&stc->frames, i);
+        if (!frame) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        checkpoint_frame(&cf, frame);
+    }
+    // the window keeps the size it was saved with
+    entries = av_realloc(so->window.entries, FFMAX(c->window_size, 1) * sizeof(*entries));
+    if (!entries) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    so->window.entries = entries;
+    so->window.size = c->window_size;
+    so->window.num = c->window_num;
+    so->window.count = c->window_count;
+    if (c->mark.dir_len && !(dir = av_malloc(c->mark.dir_len))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (i = 0; i < c->window_num; i++) {
+        checkpoint_frame(&cf, &entries[i].idx);
+        CHECKPOINT_FIELD(&cf, entries[i].num, 8);
+    }
+    if (cf.error || (c->mark.dir_len && fread(dir, 1, c->mark.dir_len, cf.f) != c->mark.dir_len)) {
+        printf("invalid checkpoint: %s\n", stc->checkpoint);
+        goto end;
+    }
+    if (sj_index_writer_resume(&stc->writer, c->filename, c->tmpname[0] ? c->tmpname : NULL, &c->mark, dir) < 0) {
+        printf("error reopening index: %s\n", c->tmpname[0] ? c->tmpname : c->filename);
+        ret = AVERROR(EIO);
+        goto end;
+    }
+    ret = c->offset;
+end:
+    if (cf.f)
+        fclose(cf.f);
+    av_free(dir);
+    av_free(c);
+    return ret;
+}
+
+static int stream_flush(ScanRange *r)
+{
+    StreamOutput *so = r->opaque;
+    StreamContext *stc = so->stc;
+    int ret = replay_range(stc, so->tc, r, &so->count_gop, &so->last_in_gop);
+
+    if (ret < 0)
+        return ret;
+    // the last frame can still get the timecode of a GOP header split over two packets
+    resolve_pts(stc, stc->frame_num - 1);
+    stream_output(so, FFMIN(stc->pts_pos, stc->frame_num - 1));
+    if (so->follow)
+        stream_release(so);
+    if (r->gop && r->last_pkt_offset >= r->checkpoint) {
+        r->checkpoint = r->last_pkt_offset + stc->checkpoint_interval;
+        return stream_checkpoint(r, so);
+    }
+    if (so->follow && so->written > so->published)
+        return stream_publish(so);
+    return 0;
+}
+
+// a followed input that has not grown for so->follow seconds is complete
+static int stream_idle(ScanRange *r)
+{
+    StreamOutput *so = r->opaque;
+
+    if ((int64_t)r->ra.idle * r->ra.follow >= so->follow * 1000LL)
+        return 1;
+    stream_release(so);
+    if (so->written > so->published)
+        return stream_publish(so);
+    return 0;
+}
+
+// the resident size includes the pages of a mapped input
+static void print_memory_usage(StreamContext *stc)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return;
+    printf("peak memory %ld KiB, frame table %lld KiB\n", usage.ru_maxrss, stc->frames.peak >> 10);
+}
+
+#define FOLLOW_POLL 200 ///< ms between two reads at the end of a followed input
+#define CHECKPOINT_INTERVAL 1024 ///< default MiB of input between two checkpoints
+
+/*
+ * indexes a program stream read sequentially from infile, "-" for the standard input,
+ * the records are written progressively and the header is completed when the writer is closed.
+ * If follow is not 0, infile is still being written : it is read until it has not grown for follow seconds
+ * and the records are published as soon as they are final.
+ * With stc->checkpoint, the state is saved every stc->checkpoint_interval input bytes and, with stc->resume,
+ * the indexing goes on from the last checkpoint instead of the start of the input.
+ * Returns the number of frames indexed or a negative error code.
+ */
+static int index_stream(char *infile, StreamContext *stc, TimeContext *tc, int depth, int buf_size, int window, int follow)
+{
+    ScanRange r;
+    StreamOutput so;
+    int64_t frames;
+    offset_t start = 0;
+    int is_stdin = !strcmp(infile, "-");
+    int fd = is_stdin ? 0 : open(infile, O_RDONLY);
+    int ret;
+
+    if (fd < 0) {
+        printf("error opening infile: %s\n", infile);
+        sj_index_writer_abort(&stc->writer);
+        return -1;
+    }
+    memset(&r, 0, sizeof(r));
+    memset(&so, 0, sizeof(so));
+    r.end = INT64_MAX;
+    r.state = -1;
+    r.checkpoint = INT64_MAX;
+    r.flush = stream_flush;
+    r.idle = stream_idle;
+    r.opaque = &so;
+    so.stc = stc;
+    so.tc = tc;
+    so.last_in_gop = -1;
+    so.window.size = window;
+    so.follow = follow;
+    so.window.entries = av_malloc(window * sizeof(*so.window.entries));
+    // the index and the checkpoint are left as they are if it cannot be resumed
+    if (so.window.entries && stc->resume && (start = stream_resume(&r, &so, fd)) < 0) {
+        frame_table_free(&stc->frames);
+        av_free(so.window.entries);
+        if (!is_stdin)
+            close(fd);
+        return start;
+    }
+    if (stc->resume && !stc->quiet)
+        printf("resuming at offset %lld, %lld frames written\n", start, so.written);
+    if (stc->checkpoint)
+        r.checkpoint = start + stc->checkpoint_interval;
+    if (!so.window.entries ||
+        read_ahead_open(&r.ra, fd, start, depth, buf_size * 1024, follow ? FOLLOW_POLL : 0) < 0) {
+        printf("error reading infile: %s\n", infile);
+        ret = -1;
+    } else {
+        ps_demux_init(&r.ps, NULL, 0, start);
+        if (!stc->quiet)
+            printf("creating index\n");
+        scan_range(&r);
+        ret = r.error;
+        if (!ret)
+            ret = replay_range(stc, tc, &r, &so.count_gop, &so.last_in_gop);
+    }
+    if (!ret) {
+        calculate_pts_from_dts(stc);
+        stream_output(&so, stc->frame_num);
+        while (so.window.num)
+            stream_pop(&so);
+        set_start_values(stc);
+        if (sj_index_writer_close(&stc->writer) < 0)
+            ret = AVERROR(EIO);
+        // the checkpoint is of no use once the index is closed or given up
+        if (stc->checkpoint)
+            unlink(stc->checkpoint);
+    }
+    frames = so.window.count;
+    read_ahead_close(&r.ra);
+    if (!is_stdin)
+        close(fd);
+    av_free(r.events);
+    av_free(so.window.entries);
+    if (!stc->quiet)
+        print_memory_usage(stc);
+    frame_table_free(&stc->frames);
+    if (ret < 0) {
+        printf("error indexing infile: %s\n", infile);
+        // the index is kept with its checkpoint, --resume goes on from it
+        if (stc->checkpoint && !access(stc->checkpoint, F_OK))
+            sj_index_writer_release(&stc->writer);
+        else
+            sj_index_writer_abort(&stc->writer);
+        return ret;
+    }
+    if (!stc->quiet)
+        printf("%lld frames\n", frames);
+    return frames;
+}
+
+// offset of the first pack starting at or after from, -1 if there is none
+static offset_t find_pack_start(ByteIOContext *pb, offset_t from)
+{
+    uint32_t state = -1;
+
+    url_fseek(pb, from, SEEK_SET);
+    while (!url_feof(pb)) {
+        state = (state << 8) | get_byte(pb);
+        if (state == PACK_START_CODE)
+            return url_ftell(pb) - 4;
+    }
+    return -1;
+}
+
+/*
+ * splits the input in at most range_num ranges starting on pack headers,
+ * returns the number of ranges
+ */
+static int split_input(char *infile, ScanRange *ranges, int range_num)
+{
+    ByteIOContext pb;
+    offset_t size;
+    int i, num = 1;
+
+    ranges[0].start = 0;
+    ranges[0].end = INT64_MAX;
+    if (range_num < 2 || url_fopen(&pb, infile, URL_RDONLY) < 0)
+        return 1;
+    size = url_fsize(&pb);
+    for (i = 1; i < range_num; i++) {
+        offset_t start = find_pack_start(&pb, size / range_num * i);
+        if (start <= ranges[num - 1].start)
+            continue;
+        ranges[num - 1].end = start;
+        ranges[num].start = start;
+        ranges[num].end = INT64_MAX;
+        num++;
+    }
+    url_fclose(&pb);
+    return num;
+}
+
+static void stream_context_init(StreamContext *stc, TimeContext *tc, int version)
+{
+    memset(stc, 0, sizeof(*stc));
+    memset(tc, 0, sizeof(*tc));
+    stc->pts_next = 1;
+    stc->start_pts = 1000000000;
+    stc->start_timecode.hours = 23;
+    stc->start_timecode.minutes = 59;
+    stc->start_timecode.seconds = 59;
+    stc->version = version;
+    // not open until sj_index_writer_open or stream_resume, an abort before that closes nothing
+    stc->writer.fd = -1;
+}
+
+/*
+ * checkpoints the indexing to outfile.ckpt every interval bytes, with resume the indexing
+ * goes on from that checkpoint if there is one. Returns 0 or -1 if memory could not be allocated.
+ */
+static int set_checkpoint(StreamContext *stc, const char *outfile, int64_t interval, int resume)
+{
+    stc->checkpoint = av_malloc(strlen(outfile) + 6);
+    if (!stc->checkpoint)
+        return -1;
+    sprintf(stc->checkpoint, "%s.ckpt", outfile);
+    stc->checkpoint_interval = interval;
+    stc->resume = resume && !access(stc->checkpoint, F_OK);
+    return 0;
+}
+
+typedef struct {
+    char *infile;
+    char *outfile;
+    int64_t size;   ///< input size, the largest files are indexed first
+} BatchJob;
+
+/*
+ * jobs of a worker, it takes them from the head while the others steal them from the tail,
+ * so that the small files left at the end are shared out
+ */
+typedef struct {
+    BatchJob **jobs;
+    int head;
+    int tail;       ///< jobs[head] to jobs[tail - 1] are queued
+    int64_t bytes;  ///< input bytes queued
+    pthread_mutex_t lock;
+} JobQueue;
+
+typedef struct {
+    JobQueue *queues;   ///< a queue per worker
+    int queue_num;
+    int version;
+    int depth;
+    int buf_size;
+    int window;
+    int64_t checkpoint;     ///< input bytes between two checkpoints of a file, 0 for none
+    int resume;             ///< the files with a checkpoint go on from it
+    pthread_mutex_t lock;   ///< protects the counters and the report lines
+    int indexed;
+    int skipped;
+    int failed;
+    int64_t bytes;          ///< input bytes indexed
+} Batch;
+
+typedef struct {
+    Batch *b;
+    int id;
+} BatchWorker;
+
+static BatchJob *job_pop(JobQueue *q, int steal)
+{
+    BatchJob *job = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        job = steal ? q->jobs[--q->tail] : q->jobs[q->head++];
+        q->bytes -= job->size;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+// a job of the queue with the most bytes left, NULL once every queue is empty
+static BatchJob *job_steal(Batch *b, int id)
+{
+    for (;;) {
+        int64_t most = 0;
+        int victim = -1;
+        int i;
+
+        for (i = 0; i < b->queue_num; i++) {
+            int64_t bytes;
+            if (i == id)
+                continue;
+            pthread_mutex_lock(&b->queues[i].lock);
+            // + 1 so that a queue of empty inputs is not taken for an empty queue
+            bytes = b->queues[i].head < b->queues[i].tail ? b->queues[i].bytes + 1 : 0;
+            pthread_mutex_unlock(&b->queues[i].lock);
+            if (bytes > most) {
+                most = bytes;
+                victim = i;
+            }
+        }
+        if (victim < 0)
+            return NULL;
+        // the victim may have been emptied meanwhile, look again
+        BatchJob *job = job_pop(&b->queues[victim], 1);
+        if (job)
+            return job;
+    }
+}
+
+static double elapsed(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return now.tv_sec - start->tv_sec + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+// indexes a file of the batch as -s does, unless its index is newer than it
+static void index_job(Batch *b, BatchJob *job)
+{
+    StreamContext stc;
+    TimeContext tc;
+    struct stat in_stat, out_stat;
+    struct timeval start;
+    double secs;
+    int frames;
+
+    if (stat(job->infile, &in_stat) < 0) {
+        pthread_mutex_lock(&b->lock);
+        printf("error opening infile: %s\n", job->infile);
+        b->failed++;
+        pthread_mutex_unlock(&b->lock);
+        return;
+    }
+    if (!stat(job->outfile, &out_stat) && out_stat.st_mtime > in_stat.st_mtime) {
+        pthread_mutex_lock(&b->lock);
+        printf("%s: up to date\n", job->infile);
+        b->skipped++;
+        pthread_mutex_unlock(&b->lock);
+        return;
+    }
+
+    gettimeofday(&start, NULL);
+    stream_context_init(&stc, &tc, b->version);
+    stc.quiet = 1;
+    if ((b->checkpoint && set_checkpoint(&stc, job->outfile, b->checkpoint, b->resume) < 0) ||
+        (!stc.resume && sj_index_writer_open(&stc.writer, job->outfile, b->version, 0) < 0)) {
+        pthread_mutex_lock(&b->lock);
+        printf("error opening outfile: %s\n", job->outfile);
+        b->failed++;
+        pthread_mutex_unlock(&b->lock);
+        av_free(stc.checkpoint);
+        return;
+    }
+    frames = index_stream(job->infile, &stc, &tc, b->depth, b->buf_size, b->window, 0);
+    secs = elapsed(&start);
+    av_free(stc.checkpoint);
+
+    pthread_mutex_lock(&b->lock);
+    if (frames < 0) {
+        b->failed++;
+    } else {
+        printf("%s: %d frames, %.1f MiB in %.2f s, %.1f MiB/s\n", job->infile, frames,
+               in_stat.st_size / 1048576.0, secs, secs > 0 ? in_stat.st_size / 1048576.0 / secs : 0);
+        b->indexed++;
+        b->bytes += in_stat.st_size;
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void *batch_worker(void *arg)
+{
+    BatchWorker *w = arg;
+    BatchJob *job;
+
+    while ((job = job_pop(&w->b->queues[w->id], 0)) || (job = job_steal(w->b, w->id)))
+        index_job(w->b, job);
+    return NULL;
+}
+
+static int job_size_cmp(const void *a, const void *b)
+{
+    const BatchJob *ja = *(BatchJob * const *)a, *jb = *(BatchJob * const *)b;
+    return ja->size > jb->size ? -1 : ja->size < jb->size;
+}
+
+static char *batch_strdup(const char *s, size_t len)
+{
+    char *d = av_malloc(len + 1);
+
+    if (d) {
+        memcpy(d, s, len);
+        d[len] = 0;
+    }
+    return d;
+}
+
+static int add_job(BatchJob ***jobs, int *job_num, const char *infile, size_t in_len, const char *outfile)
+{
+    BatchJob *job;
+    BatchJob **list;
+    struct stat in_stat;
+
+    if (!(*job_num & 63)) {
+        list = av_realloc(*jobs, (*job_num + 64) * sizeof(*list));
+        if (!list)
+            return -1;
+        *jobs = list;
+    }
+    job = av_mallocz(sizeof(*job));
+    if (!job)
+        return -1;
+    job->infile = batch_strdup(infile, in_len);
+    if (outfile) {
+        job->outfile = batch_strdup(outfile, strlen(outfile));
+    } else if ((job->outfile = av_malloc(in_len + 5))) {
+        memcpy(job->outfile, infile, in_len);
+        strcpy(job->outfile + in_len, ".idx");
+    }
+    if (!job->infile || !job->outfile) {
+        av_free(job->infile);
+        av_free(job->outfile);
+        av_free(job);
+        return -1;
+    }
+    // a missing input is reported by its worker
+    job->size = stat(job->infile, &in_stat) < 0 ? 0 : in_stat.st_size;
+    (*jobs)[(*job_num)++] = job;
+    return 0;
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+    size_t len = strlen(name), suffix_len = strlen(suffix);
+    return len >= suffix_len && !strcmp(name + len - suffix_len, suffix);
+}
+
+/*
+ * reads the batch list, either a directory whose files are indexed next to them
+ * or a manifest with a line per file: "infile" or "infile<TAB>outfile", # starting a comment
+ */
+static int read_batch(const char *list, BatchJob ***jobs, int *job_num)
+{
+    struct stat list_stat;
+    char line[2 * PATH_MAX];
+    FILE *f;
+
+    if (stat(list, &list_stat) < 0) {
+        printf("error opening batch list: %s\n", list);
+        return -1;
+    }
+    if (S_ISDIR(list_stat.st_mode)) {
+        DIR *dir = opendir(list);
+        struct dirent *de;
+        if (!dir) {
+            printf("error opening batch list: %s\n", list);
+            return -1;
+        }
+        while ((de = readdir(dir))) {
+            struct stat st;
+            int len;
+            // indexes, checkpoints and temporary files are not inputs
+            if (de->d_name[0] == '.' || has_suffix(de->d_name, ".idx") || has_suffix(de->d_name, ".ckpt") ||
+                has_suffix(de->d_name, ".tmp"))
+                continue;
+            len = snprintf(line, sizeof(line), "%s/%s", list, de->d_name);
+            if (len >= sizeof(line) || stat(line, &st) < 0 || !S_ISREG(st.st_mode))
+                continue;
+            if (add_job(jobs, job_num, line, len, NULL) < 0) {
+                printf("could not allocate memory\n");
+                closedir(dir);
+                return -1;
+            }
+        }
+        closedir(dir);
+        return 0;
+    }
+
+    if (!(f = fopen(list, "r"))) {
+        printf("error opening batch list: %s\n", list);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *tab;
+        size_t len = strcspn(line, "\r\n");
+        line[len] = 0;
+        if (!len || line[0] == '#')
+            continue;
+        tab = strchr(line, '\t');
+        if (add_job(jobs, job_num, line, tab ? tab - line : len, tab && tab[1] ? tab + 1 : NULL) < 0) {
+            printf("could not allocate memory\n");
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
     return 0;
 }
 
+/*
+ * indexes every file of a batch list on thread_num workers, each file being indexed
+ * sequentially as with -s, the largest ones first
+ */
+static int index_batch(const char *list, int thread_num, int version, int depth, int buf_size, int window,
+                       int64_t checkpoint, int resume)
+{
+    Batch b;
+    BatchJob **jobs = NULL;
+    BatchWorker *workers = NULL;
+    pthread_t *threads = NULL;
+    struct timeval start;
+    double secs;
+    int job_num = 0;
+    int started = 0;
+    int i;
+
+    memset(&b, 0, sizeof(b));
+    if (read_batch(list, &jobs, &job_num) < 0)
+        goto end;
+    qsort(jobs, job_num, sizeof(*jobs), job_size_cmp);
+
+    b.version = version;
+    b.depth = depth;
+    b.buf_size = buf_size;
+    b.window = window;
+    b.checkpoint = checkpoint;
+    b.resume = resume;
+    b.queue_num = FFMAX(FFMIN(thread_num, job_num), 1);
+    b.queues = av_mallocz(b.queue_num * sizeof(*b.queues));
+    workers = av_malloc(b.queue_num * sizeof(*workers));
+    threads = av_malloc(b.queue_num * sizeof(*threads));
+    if (!b.queues || !workers || !threads) {
+        printf("could not allocate batch workers\n");
+        b.failed = 1;
+        goto end;
+    }
+    for (i = 0; i < b.queue_num; i++) {
+        b.queues[i].jobs = av_malloc((job_num / b.queue_num + 1) * sizeof(*b.queues[i].jobs));
+        if (!b.queues[i].jobs) {
+            printf("could not allocate batch workers\n");
+            b.failed = 1;
+            goto end;
+        }
+    }
+    pthread_mutex_init(&b.lock, NULL);
+    for (i = 0; i < b.queue_num; i++)
+        pthread_mutex_init(&b.queues[i].lock, NULL);
+    // dealt in turn, each worker starts with one of the largest files
+    for (i = 0; i < job_num; i++) {
+        JobQueue *q = &b.queues[i % b.queue_num];
+        q->jobs[q->tail++] = jobs[i];
+        q->bytes += jobs[i]->size;
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < b.queue_num; i++) {
+        workers[i].b = &b;
+        workers[i].id = i;
+        if (i && pthread_create(&threads[i], NULL, batch_worker, &workers[i])) {
+            // the workers started steal the jobs of the others
+            printf("could not create batch thread\n");
+            break;
+        }
+        started = i + 1;
+    }
+    batch_worker(&workers[0]);
+    for (i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+    secs = elapsed(&start);
+
+    printf("%d indexed, %d up to date, %d failed: %.1f MiB in %.2f s, %.1f MiB/s\n",
+           b.indexed, b.skipped, b.failed, b.bytes / 1048576.0, secs, secs > 0 ? b.bytes / 1048576.0 / secs : 0);
+    for (i = 0; i < b.queue_num; i++)
+        pthread_mutex_destroy(&b.queues[i].lock);
+    pthread_mutex_destroy(&b.lock);
+end:
+    for (i = 0; b.queues && i < b.queue_num; i++)
+        av_free(b.queues[i].jobs);
+    for (i = 0; i < job_num; i++) {
+        av_free(jobs[i]->infile);
+        av_free(jobs[i]->outfile);
+        av_free(jobs[i]);
+    }
+    av_free(jobs);
+    av_free(b.queues);
+    av_free(workers);
+    av_free(threads);
+    return b.failed || !b.queues ? -1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
     AVFormatContext *ic = NULL;
     AVStream *st = NULL;
-    AVPacket pkt;
     StreamContext stcontext;
     TimeContext tc;
-    int i, ret;
-    uint32_t state = -1;
-    offset_t last_pkt_offset = 0;
-
-    memset(&stcontext, 0, sizeof(stcontext));
-    memset(&tc, 0, sizeof(tc));
+    ScanRange *ranges;
+    pthread_t *threads;
+    int range_num = 0;
+    int in_place = 0;
+    int queue_depth = 0;
+    int buf_size = 4096;
+    int direct = 0;
+    int stream = 0;
+    int window = 64;
+    int follow = 0;
+    int version = -1;
+    char *batch = NULL;
+    int checkpoint = 0;
+    int resume = 0;
+    static const struct option long_options[] = {
+        { "resume", no_argument, NULL, 'r' },
+        { NULL, 0, NULL, 0 },
+    };
+    char *infile, *outfile;
+    uint8_t *map = NULL;
+    struct stat in_stat;
+    int ret;
+    int i;
 
-    uint8_t data_buf[8]; // used to store bits when data is divided in two packets
+    stream_context_init(&stcontext, &tc, 0);
+    while ((i = getopt_long(argc, argv, "v:j:mq:b:Dsw:f:B:c:r", long_options, NULL)) != -1) {
+        switch (i) {
+        case 'v':
+            version = atoi(optarg);
+            break;
+        case 'j':
+            range_num = atoi(optarg);
+            break;
+        case 'm':
+            in_place = 1;
+            break;
+        case 'q':
+            queue_depth = atoi(optarg);
+            break;
+        case 'b':
+            buf_size = atoi(optarg);
+            break;
+        case 'D':
+            direct = 1;
+            break;
+        case 's':
+            stream = 1;
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'f':
+            follow = atoi(optarg);
+            stream = 1;
+            break;
+        case 'B':
+            batch = optarg;
+            break;
+        case 'c':
+            checkpoint = atoi(optarg);
+            break;
+        case 'r':
+            resume = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
 
-    if (argc < 3) {
-        printf("indexing infile outfile\n");
+    // a followed input is indexed so that the index can be read while it grows
+    stcontext.version = version < 0 ? (follow ? 2 : 0) : version;
+    // a batch indexes as many files at once as there are processors
+    if (!range_num)
+        range_num = batch ? FFMAX(sysconf(_SC_NPROCESSORS_ONLN), 1) : 1;
+    // a checkpoint holds the state of a stream indexing
+    if (resume && !checkpoint)
+        checkpoint = CHECKPOINT_INTERVAL;
+    if (checkpoint && !batch)
+        stream = 1;
+    if ((batch ? argc != optind : argc - optind < 2) || stcontext.version < 0 || stcontext.version > 3 || range_num < 1 ||
+        (batch && (stream || in_place || direct || stcontext.version == 1)) || checkpoint < 0 ||
+        (checkpoint && !batch && !strcmp(argv[optind], "-")) ||
+        (queue_depth && (in_place || queue_depth < 2)) || buf_size <= 0 || buf_size > INT_MAX / 1024 || (direct && buf_size % 4) ||
+        (stream && (in_place || range_num > 1 || stcontext.version == 1 || direct)) || window < 1 || follow < 0 ||
+        (follow && (!strcmp(argv[optind], "-") || stcontext.version == 3))) {
+    usage:
+        printf("indexing [-v version] [-j threads] [-m | -q depth [-b size] [-D]] infile outfile\n");
+        printf("indexing -s [-v version] [-q depth] [-b size] [-w frames] infile|- outfile\n");
+        printf("indexing -f seconds [-v version] [-q depth] [-b size] [-w frames] [-c MiB] [-r] infile outfile\n");
+        printf("indexing -c MiB [-r] [-v version] [-q depth] [-b size] [-w frames] infile outfile\n");
+        printf("indexing -B manifest|directory [-j threads] [-v version] [-q depth] [-b size] [-w frames] [-c MiB] [-r]\n");
         printf("create index file from the input program stream file\n");
+        printf("\t-v version\tindex version to write: 0 packed records (default), 1 columns,\n");
+        printf("\t\t\t2 packed records with a count (default with -f), 3 compressed blocks\n");
+        printf("\t-j threads\tnumber of threads scanning distinct parts of the input (default 1),\n");
+        printf("\t\t\tor files indexed at once with -B\n");
+        printf("\t-m\t\tmap the input and demux it in place instead of going through libavformat\n");
+        printf("\t-q depth\tread the input on a separate thread into depth buffers (at least 2) and demux them in place\n");
+        printf("\t-b size\t\tsize of the read buffers in KiB (default 4096)\n");
+        printf("\t-D\t\tread with O_DIRECT, bypassing the page cache, size must be a multiple of 4\n");
+        printf("\t-s\t\tindex a stream read sequentially from a pipe or the standard input (-), writing\n");
+        printf("\t\t\tversion 0, 2 or 3 records as they are resolved\n");
+        printf("\t-w frames\twindow putting the frames in pts order, larger than the decode delay (default 64)\n");
+        printf("\t-f seconds\tfollow an input still being written, as -s, until it has not grown for seconds,\n");
+        printf("\t\t\tthe version 0 or 2 index is appended to and its count updated as frames are final\n");
+        printf("\t-B list\tindex every file of a directory to file.idx, or every line \"infile[<tab>outfile]\"\n");
+        printf("\t\t\tof a manifest, on threads (default one per processor) reading each file as -s,\n");
+        printf("\t\t\tthe largest first, skipping those whose index is newer\n");
+        printf("\t-c MiB\t\tindex as -s, saving the state to outfile.ckpt at the first GOP after each MiB of input\n");
+        printf("\t-r, --resume\tgo on from the outfile.ckpt left by an interrupted run, with -c %d if not given\n", CHECKPOINT_INTERVAL);
         return 1;
     }
 
     register_protocol(&file_protocol);
     register_avcodec(&mpegvideo_decoder);
-    if (av_open_input_file(&ic, argv[1], &mpegps_demuxer, BUFFER_SIZE, NULL) < 0) {
-        printf("error opening infile: %s\n", argv[1]);
+    start_code_init();
+
+    if (batch)
+        return index_batch(batch, range_num, stcontext.version, queue_depth ? queue_depth : 4, buf_size, window,
+                           (int64_t)checkpoint << 20, resume) < 0;
+    // a batch takes no file arguments
+    infile = argv[optind];
+    outfile = argv[optind + 1];
+    if (stream) {
+        if (checkpoint && set_checkpoint(&stcontext, outfile, (int64_t)checkpoint << 20, resume) < 0) {
+            printf("could not allocate memory\n");
+            return 1;
+        }
+        if (resume && !stcontext.resume)
+            printf("no checkpoint %s, indexing from the start\n", stcontext.checkpoint);
+        // a followed index is read while it is written
+        if (!stcontext.resume &&
+            sj_index_writer_open(&stcontext.writer, outfile, stcontext.version, follow ? SJ_INDEX_WRITE_IN_PLACE : 0) < 0) {
+            printf("error opening outfile: %s\n", outfile);
+            av_free(stcontext.checkpoint);
+            return 1;
+        }
+        ret = index_stream(infile, &stcontext, &tc, queue_depth ? queue_depth : 4, buf_size, window, follow);
+        av_free(stcontext.checkpoint);
+        return ret < 0;
+    }
+    if (av_open_input_file(&ic, infile, &mpegps_demuxer, BUFFER_SIZE, NULL) < 0) {
+        printf("error opening infile: %s\n", infile);
         return 1;
     }
 
@@ -288,99 +1874,107 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    tc.fps = (float)stcontext.video->codec->time_base.den
-        / stcontext.video->codec->time_base.num + 0.5;
-    stcontext.frame_duration = av_rescale(1, 90000, tc.fps);
+    set_frame_rate(&stcontext, &tc, (float)stcontext.video->codec->time_base.den
+                   / stcontext.video->codec->time_base.num + 0.5);
     stcontext.fc = ic;
 
-    stcontext.start_pts = 1000000000;
-    stcontext.start_timecode.hours = 23;
-    stcontext.start_timecode.minutes = 59;
-    stcontext.start_timecode.seconds = 59;
-    stcontext.start_timecode.frames = tc.fps - 1;
-
-    if (url_fopen(&stcontext.opb, argv[2], URL_WRONLY) < 0) {
-        printf("error opening outfile: %s\n", argv[2]);
+    if (sj_index_writer_open(&stcontext.writer, outfile, stcontext.version, 0) < 0) {
+        printf("error opening outfile: %s\n", outfile);
         return 1;
     }
 
-    stcontext.index = av_malloc(1000 * sizeof(Index));
-    printf("creating index\n");
-    int count_gop = 0;
-    Index *last_in_gop = NULL;
-    while (1) {
-        ret = av_read_packet(ic, &pkt);
-        if (ret < 0)
-            break;
-
-        st = ic->streams[pkt.stream_index];
-        if (st->codec->codec_type == CODEC_TYPE_VIDEO) {
-//          records the offset of the packet in case the next picture start code begins in it and finishes in the next packet
-            offset_t pkt_offset = pes_find_packet_start(&ic->pb, url_ftell(&ic->pb) - pkt.size, st->id);
-
-            if (pkt.dts != AV_NOPTS_VALUE) {
-                stcontext.current_dts = pkt.dts;
-                stcontext.current_pts = pkt.pts;
-            }
-            if (!stcontext.start_dts) {
-                stcontext.start_dts = stcontext.current_dts;
-            }
-            if (stcontext.need_pic) {
-                memcpy(data_buf + 2 - stcontext.need_pic, pkt.data, stcontext.need_pic);
-                parse_pic_timecode(&stcontext.index[stcontext.frame_num-1], &tc, last_in_gop, data_buf);
-                stcontext.need_pic = 0;
-                assert(stcontext.index[stcontext.frame_num-1].pic_type > 0 &&
-                       stcontext.index[stcontext.frame_num-1].pic_type < 4);
-            }
-            if (stcontext.need_gop) {
-                memcpy(data_buf + 4 - stcontext.need_gop, pkt.data, stcontext.need_gop);
-                if (!tc.timecode_generate)
-                    parse_gop_timecode(&stcontext.index[stcontext.frame_num-1], &tc, data_buf);
-                if (count_gop == 2)
-                    check_timecode_presence(&tc);
-               stcontext.need_gop = 0;
+    ranges = av_mallocz(range_num * sizeof(*ranges));
+    threads = av_malloc(range_num * sizeof(*threads));
+    if (!ranges || !threads) {
+        printf("could not allocate scan ranges\n");
+        goto fail;
+    }
+    range_num = split_input(infile, ranges, range_num);
+    if (in_place) {
+        int fd = open(infile, O_RDONLY);
+        if (fd < 0 || fstat(fd, &in_stat) < 0 ||
+            (map = mmap(NULL, in_stat.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            printf("error mapping infile: %s\n", infile);
+            goto fail;
+        }
+        close(fd);
+        posix_madvise(map, in_stat.st_size, POSIX_MADV_SEQUENTIAL);
+    }
+    // the first range goes on with the context used to probe the streams
+    ranges[0].ic = ic;
+    for (i = 0; i < range_num; i++) {
+        ranges[i].video_id = stcontext.video->id;
+        ranges[i].state = -1;
+        if (in_place) {
+            // each range parses from its start up to the end of the file, for the seam
+            ranges[i].ic = NULL;
+            ps_demux_init(&ranges[i].ps, map + ranges[i].start, in_stat.st_size - ranges[i].start, ranges[i].start);
+            continue;
+        }
+        if (queue_depth) {
+            ranges[i].ic = NULL;
+            ranges[i].fd = open(infile, O_RDONLY | (direct ? O_DIRECT : 0));
+            // not every file system supports O_DIRECT
+            if (ranges[i].fd < 0 && direct && errno == EINVAL)
+                ranges[i].fd = open(infile, O_RDONLY);
+            if (ranges[i].fd < 0 ||
+                read_ahead_open(&ranges[i].ra, ranges[i].fd, ranges[i].start, queue_depth, buf_size * 1024, 0) < 0) {
+                printf("error reading infile: %s\n", infile);
+                goto fail;
             }
-            for (i = 0; i < pkt.size; i++) {
-                Index *idx = &stcontext.index[stcontext.frame_num];
-                i = ff_find_start_code(pkt.data + i, pkt.data + pkt.size, &state) - pkt.data - 1;
-                if (state == GOP_START_CODE) {
-                    last_in_gop = &stcontext.index[stcontext.frame_num - 1];
-                    int bytes = FFMIN(pkt.size - i - 1, 4);
-                    memcpy(data_buf, pkt.data + i + 1, bytes);
-                    stcontext.need_gop = 4 - bytes;
-                    count_gop++;
-                    if (!stcontext.need_gop && !tc.timecode_generate) {
-                        parse_gop_timecode(idx, &tc, data_buf);
-                        if (count_gop == 2)
-                            check_timecode_presence(&tc);
-                    }
-                } else if (state == PICTURE_START_CODE) {
-                    int bytes = FFMIN(pkt.size - i - 1, 2);
-                    memcpy(data_buf, pkt.data + i + 1, bytes);
-                    stcontext.need_pic = 2 - bytes;
+            ps_demux_init(&ranges[i].ps, NULL, 0, ranges[i].start);
+            continue;
+        }
+        if (!i)
+            continue;
+        if (av_open_input_file(&ranges[i].ic, infile, &mpegps_demuxer, BUFFER_SIZE, NULL) < 0) {
+            printf("error opening infile: %s\n", infile);
+            goto fail;
+        }
+        url_fseek(&ranges[i].ic->pb, ranges[i].start, SEEK_SET);
+    }
 
-                    // check if startcode begins in last packet
-                    idx->pes_offset = i < 3 ? last_pkt_offset : pkt_offset;
-
-                    if (!stcontext.need_pic) {
-                        parse_pic_timecode(idx, &tc, last_in_gop, data_buf);
-                    }
-                    idx_set_timestamps(&stcontext, idx, &pkt, st);
-                    stcontext.frame_num++;
-                    if (!(stcontext.frame_num % 1000)){
-                        stcontext.index = av_realloc(stcontext.index, (stcontext.frame_num + 1000) * sizeof(Index));
-                    }
-                }
-            }
-            last_pkt_offset = pkt_offset;
+    printf("creating index\n");
+    for (i = 1; i < range_num; i++) {
+        if (pthread_create(&threads[i], NULL, scan_range, &ranges[i])) {
+            printf("could not create scan thread\n");
+            goto fail;
         }
-        av_free_packet(&pkt);
     }
+    scan_range(&ranges[0]);
+    for (i = 1; i < range_num; i++)
+        pthread_join(threads[i], NULL);
+
+    int count_gop = 0;
+    int last_in_gop = -1;
+    for (i = 0; i < range_num; i++) {
+        if (ranges[i].error < 0 || replay_range(&stcontext, &tc, &ranges[i], &count_gop, &last_in_gop) < 0) {
+            printf("error indexing infile: %s\n", infile);
+            goto fail;
+        }
+        av_freep(&ranges[i].events);
+        if (i && ranges[i].ic)
+            av_close_input_file(ranges[i].ic);
+        if (ranges[i].ra.started) {
+            read_ahead_close(&ranges[i].ra);
+            close(ranges[i].fd);
+        }
+    }
+    av_free(ranges);
+    av_free(threads);
+    if (map)
+        munmap(map, in_stat.st_size);
     calculate_pts_from_dts(&stcontext);
-    write_index(&stcontext);
+    if (write_index(&stcontext, window) < 0) {
+        printf("error writing outfile: %s\n", outfile);
+        goto fail;
+    }
     av_close_input_file(ic);
-    url_fclose(&stcontext.opb);
-    av_free(stcontext.index);
+    print_memory_usage(&stcontext);
+    frame_table_free(&stcontext.frames);
     printf("%d frames\n", stcontext.frame_num);
     return 0;
+fail:
+    sj_index_writer_abort(&stcontext.writer);
+    return 1;
 }
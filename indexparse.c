@@ -1,5 +1,33 @@
 #include <ffmpeg/avformat.h>
 
+#include "libsjindex/indexer.h"
+#include "libsjindex/sj_search_index.h"
+
+// columns and compressed blocks can't be dumped sequentially and version 2 files may end with a partial record,
+// they are read back with libsjindex
+static int dump_columns(char *filename)
+{
+    SJ_IndexContext sj_ic;
+    int i;
+
+    if (sj_index_load(filename, &sj_ic) < 0) {
+        printf("error loading index %s\n", filename);
+        return 1;
+    }
+    printf("Indexes : %d\n", sj_ic.index_num);
+    for (i = 0; i < sj_ic.index_num; i++) {
+        Index *idx = &sj_ic.indexes[i];
+        printf("-----------------------\n");
+        printf("pts %lld\n", idx->pts);
+        printf("dts %lld\n", idx->dts);
+        printf("pes_offset %lld\n", idx->pes_offset);
+        printf("frame type %d\n", idx->pic_type);
+        printf("Timecode : %02d:%02d:%02d:%02d\n", idx->timecode.frames, idx->timecode.seconds, idx->timecode.minutes, idx->timecode.hours);
+    }
+    sj_index_unload(&sj_ic);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     ByteIOContext pb1, *pb = &pb1;
@@ -34,10 +62,15 @@ int main(int argc, char **argv)
     get_buffer(mpeg, buffer, 16); \
     av_hex_dump(stdout, buffer, 16); \*/
     printf("magic %llx\n", get_le64(pb));
-    printf("Version : %d\n", get_byte(pb));
+    int version = get_byte(pb);
+    printf("Version : %d\n", version);
     printf("Start PTS : %lld\n",get_le64(pb));
     printf("Start DTS : %lld\n",get_le64(pb));
     printf("Start Timecode : %02d:%02d:%02d:%02d\n", get_byte(pb), get_byte(pb), get_byte(pb), get_byte(pb));
+    if (version >= 1 && version <= 3) {
+        url_fclose(pb);
+        return dump_columns(argv[1]);
+    }
     while (!url_feof(pb)) {
         printf("-----------------------\n");
         printf("pts %lld\n", get_le64(pb));
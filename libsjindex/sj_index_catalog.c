@@ -0,0 +1,245 @@
+/*
+ * sj_index_catalog.c routes searches over many index files to the files
+ * whose span holds the searched value
+ *
+ */
+#include <ffmpeg/avformat.h>
+#include <stdlib.h>
+#include <string.h>
+#include "indexer.h"
+#include "sj_search_index.h"
+#include "sj_index_catalog.h"
+
+// same key as the timecode searches of sj_search_index.c
+static av_always_inline uint32_t pack_timecode(Timecode tc)
+{
+    return (uint8_t)tc.hours << 24 | (uint8_t)tc.minutes << 16 | (uint8_t)tc.seconds << 8 | (uint8_t)tc.frames;
+}
+
+static av_always_inline uint32_t timecode_key(uint64_t search_time)
+{
+    return (search_time / 1000000) << 24 | (search_time / 10000 % 100) << 16 | (search_time / 100 % 100) << 8 | search_time % 100;
+}
+
+int sj_index_catalog_init(SJ_IndexCatalog *cat, int max_open, int flags)
+{
+    int i;
+
+    memset(cat, 0, sizeof(*cat));
+    cat->file_num = max_open > 0 ? max_open : SJ_INDEX_CATALOG_MAX_OPEN;
+    cat->flags = flags;
+    cat->files = av_mallocz(cat->file_num * sizeof(*cat->files));
+    if (!cat->files)
+        return -1;
+    for (i = 0; i < cat->file_num; i++)
+        cat->files[i].asset = -1;
+    return 0;
+}
+
+static void drop_orders(SJ_IndexCatalog *cat)
+{
+    av_freep(&cat->tc_order);
+    av_freep(&cat->tc_max_last);
+    av_freep(&cat->pts_order);
+    av_freep(&cat->pts_max_last);
+}
+
+int sj_index_catalog_add(SJ_IndexCatalog *cat, const char *filename)
+{
+    SJ_IndexCatalogEntry *e;
+    SJ_IndexContext sj_ic;
+    Index first, last;
+    int len = strlen(filename) + 1;
+    int ret;
+
+    // only the header and the pages of the first and last indexes are read
+    ret = sj_index_load2((char *)filename, &sj_ic, SJ_INDEX_LOAD_LAZY);
+    if (ret < 0)
+        return ret;
+    if (sj_index_get(&sj_ic, 0, &first) < 0 || sj_index_get(&sj_ic, sj_ic.index_num - 1, &last) < 0) {
+        sj_index_unload(&sj_ic);
+        return -2;
+    }
+
+    if (cat->entry_num == cat->entry_size) {
+        int size = FFMAX(2 * cat->entry_size, 64);
+        SJ_IndexCatalogEntry *entries = av_realloc(cat->entries, size * sizeof(*entries));
+        if (!entries)
+            goto fail;
+        cat->entries = entries;
+        cat->entry_size = size;
+    }
+    if (cat->names_len + len > cat->names_size) {
+        int size = FFMAX(2 * cat->names_size, cat->names_len + len);
+        char *names = av_realloc(cat->names, size);
+        if (!names)
+            goto fail;
+        cat->names = names;
+        cat->names_size = size;
+    }
+    e = &cat->entries[cat->entry_num];
+    e->name = cat->names_len;
+    memcpy(cat->names + cat->names_len, filename, len);
+    cat->names_len += len;
+    e->index_num = sj_ic.index_num;
+    e->start_pts = sj_ic.start_pts;
+    e->start_dts = sj_ic.start_dts;
+    e->start_timecode = sj_ic.start_timecode;
+    // the indexes are in pts order
+    e->first_pts = first.pts;
+    e->last_pts = last.pts;
+    e->first_tc = pack_timecode(first.timecode);
+    e->last_tc = pack_timecode(last.timecode);
+    sj_index_unload(&sj_ic);
+    // sorted again on the next search
+    drop_orders(cat);
+    return cat->entry_num++;
+fail:
+    sj_index_unload(&sj_ic);
+    return -1;
+}
+
+typedef struct {
+    int64_t key;
+    int asset;
+} CatalogKey;
+
+static int catalog_key_cmp(const void *a, const void *b)
+{
+    const CatalogKey *ka = a, *kb = b;
+    return ka->key < kb->key ? -1 : ka->key > kb->key;
+}
+
+/*
+ * sorts the entries by first key, the highest last key up to each position tells
+ * how far back an entry can still hold a value
+ */
+static int sort_entries(SJ_IndexCatalog *cat)
+{
+    int n = cat->entry_num;
+    CatalogKey *keys = av_malloc(n * sizeof(*keys));
+    int i;
+
+    cat->tc_order = av_malloc(n * sizeof(*cat->tc_order));
+    cat->tc_max_last = av_malloc(n * sizeof(*cat->tc_max_last));
+    cat->pts_order = av_malloc(n * sizeof(*cat->pts_order));
+    cat->pts_max_last = av_malloc(n * sizeof(*cat->pts_max_last));
+    if (!keys || !cat->tc_order || !cat->tc_max_last || !cat->pts_order || !cat->pts_max_last) {
+        av_free(keys);
+        drop_orders(cat);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        keys[i].key = cat->entries[i].first_tc;
+        keys[i].asset = i;
+    }
+    qsort(keys, n, sizeof(*keys), catalog_key_cmp);
+    for (i = 0; i < n; i++) {
+        uint32_t last = cat->entries[keys[i].asset].last_tc;
+        cat->tc_order[i] = keys[i].asset;
+        cat->tc_max_last[i] = i ? FFMAX(cat->tc_max_last[i - 1], last) : last;
+    }
+    for (i = 0; i < n; i++) {
+        keys[i].key = cat->entries[i].first_pts;
+        keys[i].asset = i;
+    }
+    qsort(keys, n, sizeof(*keys), catalog_key_cmp);
+    for (i = 0; i < n; i++) {
+        int64_t last = cat->entries[keys[i].asset].last_pts;
+        cat->pts_order[i] = keys[i].asset;
+        cat->pts_max_last[i] = i ? FFMAX(cat->pts_max_last[i - 1], last) : last;
+    }
+    av_free(keys);
+    return 0;
+}
+
+// the open context of an asset, the file least recently searched is closed to open it
+static SJ_IndexContext *open_asset(SJ_IndexCatalog *cat, int asset)
+{
+    SJ_IndexCatalogFile *f = &cat->files[0];
+    int i;
+
+    for (i = 0; i < cat->file_num; i++) {
+        if (cat->files[i].asset == asset) {
+            f = &cat->files[i];
+            f->last_use = ++cat->uses;
+            return &f->sj_ic;
+        }
+        if (cat->files[i].asset < 0 || (f->asset >= 0 && cat->files[i].last_use < f->last_use))
+            f = &cat->files[i];
+    }
+    if (f->asset >= 0) {
+        sj_index_unload(&f->sj_ic);
+        f->asset = -1;
+    }
+    if (sj_index_load2(cat->names + cat->entries[asset].name, &f->sj_ic, cat->flags) < 0)
+        return NULL;
+    f->asset = asset;
+    f->last_use = ++cat->uses;
+    return &f->sj_ic;
+}
+
+int sj_index_catalog_search(SJ_IndexCatalog *cat, uint64_t search_time, Index *idx, Index *key_frame, uint64_t mode)
+{
+    uint64_t key;
+    int low = 0, high = cat->entry_num;
+    int i;
+
+    if (mode != SJ_INDEX_TIMECODE_SEARCH && mode != SJ_INDEX_PTS_SEARCH)
+        return -4;
+    if (!cat->entry_num)
+        return -1;
+    if (!cat->tc_order && sort_entries(cat) < 0)
+        return -1;
+    key = mode == SJ_INDEX_TIMECODE_SEARCH ? timecode_key(search_time) : search_time;
+
+    // first entry starting after key
+    while (low < high) {
+        int mid = (low + high) / 2;
+        int64_t first = mode == SJ_INDEX_TIMECODE_SEARCH ? cat->entries[cat->tc_order[mid]].first_tc :
+                                                           cat->entries[cat->pts_order[mid]].first_pts;
+        if (first <= (int64_t)key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    // the entries before it whose span reaches key
+    for (i = low - 1; i >= 0; i--) {
+        const SJ_IndexCatalogEntry *e;
+        SJ_IndexContext *sj_ic;
+        int asset;
+        if (mode == SJ_INDEX_TIMECODE_SEARCH ? cat->tc_max_last[i] < key : cat->pts_max_last[i] < (int64_t)key)
+            break;
+        asset = mode == SJ_INDEX_TIMECODE_SEARCH ? cat->tc_order[i] : cat->pts_order[i];
+        e = &cat->entries[asset];
+        if (mode == SJ_INDEX_TIMECODE_SEARCH ? e->last_tc < key : e->last_pts < (int64_t)key)
+            continue;
+        if (!(sj_ic = open_asset(cat, asset)))
+            continue;
+        if (sj_index_search(sj_ic, search_time, idx, key_frame, mode) >= 0)
+            return asset;
+    }
+    return -1;
+}
+
+const char *sj_index_catalog_filename(const SJ_IndexCatalog *cat, int asset)
+{
+    if (asset < 0 || asset >= cat->entry_num)
+        return NULL;
+    return cat->names + cat->entries[asset].name;
+}
+
+void sj_index_catalog_close(SJ_IndexCatalog *cat)
+{
+    int i;
+
+    for (i = 0; i < cat->file_num; i++) {
+        if (cat->files && cat->files[i].asset >= 0)
+            sj_index_unload(&cat->files[i].sj_ic);
+    }
+    drop_orders(cat);
+    av_free(cat->files);
+    av_free(cat->entries);
+    av_free(cat->names);
+    memset(cat, 0, sizeof(*cat));
+}
@@ -0,0 +1,84 @@
+#ifndef SJ_INDEX_CATALOG_H
+#define SJ_INDEX_CATALOG_H
+
+#define SJ_INDEX_CATALOG_MAX_OPEN 16 /// default number of index files kept open
+
+/**
+ * Catalog entry, the first and last keys of an index file
+ */
+typedef struct {
+    int name; /// offset of the file name in the catalog name pool
+    int index_num; /// number of indexes in the file
+    int64_t start_pts; /// header values of the file
+    int64_t start_dts;
+    Timecode start_timecode;
+    int64_t first_pts; /// pts of the first and last index, the pts span of the file
+    int64_t last_pts;
+    uint32_t first_tc; /// packed timecode (hours << 24 | minutes << 16 | seconds << 8 | frames) of the first and last index
+    uint32_t last_tc;
+} SJ_IndexCatalogEntry;
+
+/**
+ * File of a catalog kept open
+ */
+typedef struct {
+    int asset; /// entry of the file, -1 if the slot is free
+    int64_t last_use; /// value of the catalog use counter when it was last searched
+    SJ_IndexContext sj_ic;
+} SJ_IndexCatalogFile;
+
+/**
+ * Catalog of index files, initialized with sj_index_catalog_init.
+ * The files are registered with sj_index_catalog_add, which only keeps the header and the span of each file.
+ * sj_index_catalog_search finds the files whose span holds the searched value and searches them,
+ * opening them as needed and keeping the last ones searched open.
+ */
+typedef struct {
+    SJ_IndexCatalogEntry *entries; /// registered files, an asset number is a position in entries
+    int entry_num;
+    int entry_size; /// allocated entries
+    char *names; /// file names, each followed by a 0
+    int names_len;
+    int names_size;
+    int *tc_order; /// entries sorted by first timecode, NULL until the first search after an add
+    uint32_t *tc_max_last; /// highest last timecode of the entries up to each position of tc_order
+    int *pts_order; /// entries sorted by first pts
+    int64_t *pts_max_last; /// highest last pts of the entries up to each position of pts_order
+    SJ_IndexCatalogFile *files; /// files kept open
+    int file_num; /// most files kept open
+    int flags; /// sj_index_load2 flags the files are opened with
+    int64_t uses; /// searches made, orders the open files by last use
+} SJ_IndexCatalog;
+
+/**
+ * Initializes an empty catalog keeping at most max_open files open (SJ_INDEX_CATALOG_MAX_OPEN if 0),
+ * opened with the sj_index_load2 flags. Returns 0 or -1 if memory could not be allocated.
+ */
+int sj_index_catalog_init(SJ_IndexCatalog *cat, int max_open, int flags);
+
+/**
+ * Registers the index file filename, reading its header and its first and last indexes only.
+ * Returns the asset number of the file or a sj_index_load2 error code.
+ */
+int sj_index_catalog_add(SJ_IndexCatalog *cat, const char *filename);
+
+/**
+ * Searches search_time in the files whose span holds it, as sj_index_search, from the file starting the
+ * closest before it back.
+ * mode is SJ_INDEX_TIMECODE_SEARCH or SJ_INDEX_PTS_SEARCH, dts are not ordered across a file.
+ * Returns the asset number of the first file holding the frame, -1 if it was not found or -4 if mode is invalid.
+ * A file that can no longer be opened is skipped.
+ */
+int sj_index_catalog_search(SJ_IndexCatalog *cat, uint64_t search_time, Index *idx, Index *key_frame, uint64_t mode);
+
+/**
+ * Returns the file name of an asset, NULL if there is no such asset.
+ */
+const char *sj_index_catalog_filename(const SJ_IndexCatalog *cat, int asset);
+
+/**
+ * Closes the open files and frees the catalog.
+ */
+void sj_index_catalog_close(SJ_IndexCatalog *cat);
+
+#endif /* SJ_INDEX_CATALOG_H */
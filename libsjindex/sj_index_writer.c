@@ -0,0 +1,368 @@
+/*
+ * sj_index_writer.c writes index files in large blocks,
+ * to a temporary file renamed once complete or in place for readers following it
+ *
+ */
+#define _XOPEN_SOURCE 600
+#include <ffmpeg/avformat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "indexer.h"
+#include "sj_index_writer.h"
+
+// same layout as read by sj_search_index.c
+#define INDEX_SIZE 29
+#define HEADER_SIZE 29
+#define COLUMNS_HEADER_SIZE 64
+#define INDEX_MAGIC 0x534A2D494E444558LL
+#define BLOCK_DIR_ENTRY_SIZE 36
+// tag, three 64 bits varints and a timecode
+#define BLOCK_ENTRY_MAX_SIZE (1 + 3 * 10 + 4)
+
+static av_always_inline void sj_wl32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static av_always_inline void sj_wl64(uint8_t *p, uint64_t v)
+{
+    sj_wl32(p, v);
+    sj_wl32(p + 4, v >> 32);
+}
+
+static av_always_inline uint32_t pack_timecode(Timecode tc)
+{
+    return (uint8_t)tc.hours << 24 | (uint8_t)tc.minutes << 16 | (uint8_t)tc.seconds << 8 | (uint8_t)tc.frames;
+}
+
+// small values of either sign take few bytes
+static av_always_inline uint8_t *put_varint(uint8_t *p, int64_t v)
+{
+    uint64_t u = (uint64_t)v << 1 ^ (uint64_t)(v >> 63);
+
+    while (u >= 0x80) {
+        *p++ = u | 0x80;
+        u >>= 7;
+    }
+    *p++ = u;
+    return p;
+}
+
+static int write_at(SJ_IndexWriter *w, const uint8_t *buf, size_t size, off_t offset)
+{
+    while (size && !w->error) {
+        ssize_t ret = pwrite(w->fd, buf, size, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            w->error = -1;
+            break;
+        }
+        buf += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return w->error;
+}
+
+static int flush_block(SJ_IndexWriter *w)
+{
+    if (write_at(w, w->buf, w->buf_len, w->offset) < 0)
+        return -1;
+    w->offset += w->buf_len;
+    w->buf_len = 0;
+    return 0;
+}
+
+// room for size more bytes in the block, NULL on error
+static av_always_inline uint8_t *reserve(SJ_IndexWriter *w, int size)
+{
+    if (w->buf_len + size > SJ_INDEX_WRITE_BLOCK && flush_block(w) < 0)
+        return NULL;
+    w->buf_len += size;
+    return w->buf + w->buf_len - size;
+}
+
+/*
+ * the start values are written first and the count on its own, the header of
+ * versions 1 to 3 is padded to 64 bytes with the number of indexes at offset 32,
+ * version 3 adds the indexes per block at offset 40 and the directory offset at 48
+ */
+static int write_header(SJ_IndexWriter *w, int size)
+{
+    uint8_t header[COLUMNS_HEADER_SIZE];
+
+    memset(header, 0, sizeof(header));
+    sj_wl64(header, INDEX_MAGIC);
+    header[8] = w->version;
+    sj_wl64(header + 9, w->start_pts);
+    sj_wl64(header + 17, w->start_dts);
+    header[25] = w->start_timecode.frames;
+    header[26] = w->start_timecode.seconds;
+    header[27] = w->start_timecode.minutes;
+    header[28] = w->start_timecode.hours;
+    sj_wl64(header + 32, w->count);
+    if (w->version == 3) {
+        sj_wl32(header + 40, SJ_INDEX_BLOCK_ENTRIES);
+        sj_wl64(header + 48, w->offset);
+        // a version 3 index is not read while it is written
+        size = COLUMNS_HEADER_SIZE;
+    }
+    if (write_at(w, header, size, 0) < 0)
+        return -1;
+    if (w->version && size < COLUMNS_HEADER_SIZE)
+        return write_at(w, header + 32, 8, 32);
+    return 0;
+}
+
+int sj_index_writer_open(SJ_IndexWriter *w, const char *filename, int version, int flags)
+{
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+    if (version < 0 || version > 3)
+        return -5;
+    w->version = version;
+    w->filename = av_strdup(filename);
+    w->buf = av_malloc(SJ_INDEX_WRITE_BLOCK);
+    if (!w->filename || !w->buf)
+        goto fail;
+    if (!(flags & SJ_INDEX_WRITE_IN_PLACE)) {
+        // next to the index so that the rename stays on the same file system
+        w->tmpname = av_malloc(strlen(filename) + 32);
+        if (!w->tmpname)
+            goto fail;
+        snprintf(w->tmpname, strlen(filename) + 32, "%s.%d.tmp", filename, (int)getpid());
+    }
+    w->fd = open(w->tmpname ? w->tmpname : filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (w->fd < 0)
+        goto fail;
+    w->offset = version ? COLUMNS_HEADER_SIZE : HEADER_SIZE;
+    // the index is empty until the first publish
+    if (write_header(w, w->offset) < 0)
+        goto fail;
+    return 0;
+fail:
+    sj_index_writer_abort(w);
+    return -1;
+}
+
+/*
+ * the first index of a block is stored whole in the directory, the block keeps its picture type.
+ * The next ones are a tag (picture type, bit 7 set if the timecode is the next one) followed by
+ * the change of the pts step, the change of dts - pts, the pes offset difference and the timecode
+ * if it is not the next one
+ */
+static int add_block_entry(SJ_IndexWriter *w, const Index *idx)
+{
+    uint32_t tc = pack_timecode(idx->timecode);
+    uint8_t *p, *start;
+
+    if (!(w->count % SJ_INDEX_BLOCK_ENTRIES)) {
+        uint8_t *dir = av_realloc(w->dir, w->dir_len + BLOCK_DIR_ENTRY_SIZE);
+        if (!dir) {
+            w->error = -1;
+            return -1;
+        }
+        w->dir = dir;
+        dir += w->dir_len;
+        w->dir_len += BLOCK_DIR_ENTRY_SIZE;
+        sj_wl64(dir, w->offset + w->buf_len);
+        sj_wl64(dir + 8, idx->pts);
+        sj_wl64(dir + 16, idx->dts);
+        sj_wl64(dir + 24, idx->pes_offset);
+        sj_wl32(dir + 32, tc);
+        if (!(p = reserve(w, 1)))
+            return -1;
+        *p = idx->pic_type;
+        w->last_step = 0;
+    } else {
+        // differences wrap around, the reader undoes them the same way
+        int64_t step = (uint64_t)idx->pts - w->last.pts;
+        if (!(start = p = reserve(w, BLOCK_ENTRY_MAX_SIZE)))
+            return -1;
+        *p++ = (idx->pic_type & 0x7f) | (tc == pack_timecode(w->last.timecode) + 1) << 7;
+        p = put_varint(p, (uint64_t)step - w->last_step);
+        p = put_varint(p, ((uint64_t)idx->dts - idx->pts) - ((uint64_t)w->last.dts - w->last.pts));
+        p = put_varint(p, (uint64_t)idx->pes_offset - w->last.pes_offset);
+        if (!(*start & 0x80)) {
+            sj_wl32(p, tc);
+            p += 4;
+        }
+        w->buf_len -= BLOCK_ENTRY_MAX_SIZE - (p - start);
+        w->last_step = step;
+    }
+    w->last = *idx;
+    w->count++;
+    return 0;
+}
+
+int sj_index_writer_add(SJ_IndexWriter *w, const Index *idx)
+{
+    uint8_t *rec;
+
+    if (w->version == 3)
+        return add_block_entry(w, idx);
+    if (!(rec = reserve(w, INDEX_SIZE)))
+        return -1;
+    sj_wl64(rec, idx->pts);
+    sj_wl64(rec + 8, idx->dts);
+    sj_wl64(rec + 16, idx->pes_offset);
+    rec[24] = idx->pic_type;
+    rec[25] = idx->timecode.frames;
+    rec[26] = idx->timecode.seconds;
+    rec[27] = idx->timecode.minutes;
+    rec[28] = idx->timecode.hours;
+    w->count++;
+    return 0;
+}
+
+int sj_index_writer_columns(SJ_IndexWriter *w, int count, void (*get_index)(void *opaque, int i, Index *idx), void *opaque)
+{
+    Index idx;
+    uint8_t *p;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (!(p = reserve(w, 8)))
+            return -1;
+        get_index(opaque, i, &idx);
+        sj_wl64(p, idx.pts);
+    }
+    for (i = 0; i < count; i++) {
+        if (!(p = reserve(w, 8)))
+            return -1;
+        get_index(opaque, i, &idx);
+        sj_wl64(p, idx.dts);
+    }
+    for (i = 0; i < count; i++) {
+        if (!(p = reserve(w, 8)))
+            return -1;
+        get_index(opaque, i, &idx);
+        sj_wl64(p, idx.pes_offset);
+    }
+    for (i = 0; i < count; i++) {
+        get_index(opaque, i, &idx);
+        if (!(p = reserve(w, 4)))
+            return -1;
+        sj_wl32(p, pack_timecode(idx.timecode));
+    }
+    for (i = 0; i < count; i++) {
+        if (!(p = reserve(w, 1)))
+            return -1;
+        get_index(opaque, i, &idx);
+        *p = idx.pic_type;
+    }
+    w->count += count;
+    return 0;
+}
+
+int sj_index_writer_publish(SJ_IndexWriter *w)
+{
+    if (flush_block(w) < 0)
+        return -1;
+    // records added later are written over the directory
+    if (w->version == 3 && write_at(w, w->dir, w->dir_len, w->offset) < 0)
+        return -1;
+    return write_header(w, HEADER_SIZE);
+}
+
+int sj_index_writer_sync(SJ_IndexWriter *w, SJ_IndexWriterMark *mark)
+{
+    if (sj_index_writer_publish(w) < 0 || fsync(w->fd) < 0)
+        return -1;
+    memset(mark, 0, sizeof(*mark));
+    mark->version = w->version;
+    mark->offset = w->offset;
+    mark->count = w->count;
+    mark->dir_len = w->dir_len;
+    mark->last = w->last;
+    mark->last_step = w->last_step;
+    return 0;
+}
+
+int sj_index_writer_resume(SJ_IndexWriter *w, const char *filename, const char *tmpname,
+                           const SJ_IndexWriterMark *mark, const uint8_t *dir)
+{
+    uint8_t count[8];
+
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+    if (mark->version < 0 || mark->version > 3)
+        return -5;
+    w->version = mark->version;
+    w->filename = av_strdup(filename);
+    w->tmpname = tmpname ? av_strdup(tmpname) : NULL;
+    w->buf = av_malloc(SJ_INDEX_WRITE_BLOCK);
+    w->dir = mark->dir_len ? av_malloc(mark->dir_len) : NULL;
+    if (!w->filename || (tmpname && !w->tmpname) || !w->buf || (mark->dir_len && !w->dir))
+        goto fail;
+    w->fd = open(tmpname ? tmpname : filename, O_WRONLY);
+    if (w->fd < 0)
+        goto fail;
+    w->offset = mark->offset;
+    w->count = mark->count;
+    w->dir_len = mark->dir_len;
+    if (dir)
+        memcpy(w->dir, dir, mark->dir_len);
+    w->last = mark->last;
+    w->last_step = mark->last_step;
+    // the count goes back first, a reader following the file never counts a dropped record
+    sj_wl64(count, w->count);
+    if ((w->version && write_at(w, count, 8, 32) < 0) || ftruncate(w->fd, w->offset) < 0)
+        goto fail;
+    return 0;
+fail:
+    // the file is left for another attempt
+    sj_index_writer_release(w);
+    return -1;
+}
+
+int sj_index_writer_close(SJ_IndexWriter *w)
+{
+    int ret = sj_index_writer_publish(w);
+
+    // the data reaches the disk before the name points to it
+    if (!ret && w->tmpname && fsync(w->fd) < 0)
+        ret = -1;
+    if (close(w->fd) < 0)
+        ret = -1;
+    w->fd = -1;
+    if (!ret && w->tmpname && rename(w->tmpname, w->filename) < 0)
+        ret = -1;
+    if (ret < 0) {
+        sj_index_writer_abort(w);
+        return -1;
+    }
+    av_free(w->filename);
+    av_free(w->tmpname);
+    av_free(w->buf);
+    av_free(w->dir);
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+    return 0;
+}
+
+void sj_index_writer_abort(SJ_IndexWriter *w)
+{
+    if (w->tmpname)
+        unlink(w->tmpname);
+    sj_index_writer_release(w);
+}
+
+void sj_index_writer_release(SJ_IndexWriter *w)
+{
+    if (w->fd >= 0)
+        close(w->fd);
+    av_free(w->filename);
+    av_free(w->tmpname);
+    av_free(w->buf);
+    av_free(w->dir);
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+}
@@ -0,0 +1,109 @@
+#ifndef SJ_INDEX_WRITER_H
+#define SJ_INDEX_WRITER_H
+
+/* sj_index_writer_open flags */
+#define SJ_INDEX_WRITE_IN_PLACE 1 /// write the file itself instead of a temporary file renamed on close, for readers following it
+
+#define SJ_INDEX_WRITE_BLOCK (1 << 20) /// size of the blocks written to the file
+#define SJ_INDEX_BLOCK_ENTRIES 256 /// indexes per compressed block of a version 3 index
+
+/**
+ * Index file writer, the records are serialized in a block buffer written to the file when full.
+ * Initialized with sj_index_writer_open, the start values are set by the caller before
+ * sj_index_writer_publish or sj_index_writer_close.
+ */
+typedef struct {
+    int fd;
+    int version; /// version of the index file, 0 to 3
+    char *filename; /// index file name
+    char *tmpname; /// file written until sj_index_writer_close renames it, NULL with SJ_INDEX_WRITE_IN_PLACE
+    uint8_t *buf; /// block being filled
+    int buf_len; /// bytes in the block
+    int64_t offset; /// file offset of the block
+    int64_t count; /// number of indexes written
+    int error; /// set once a write failed, every following call fails
+    int64_t start_pts; /// pts of the first frame to be displayed
+    int64_t start_dts; /// dts of the first frame to be decoded
+    Timecode start_timecode; /// timecode of the first frame to be displayed
+    uint8_t *dir; /// block directory of a version 3 index, as written to the file
+    int dir_len; /// bytes in dir
+    Index last; /// previous index of a version 3 block, the next one is encoded from it
+    int64_t last_step; /// pts difference between last and the index before it
+} SJ_IndexWriter;
+
+/**
+ * Position of a writer whose records are on disk, enough to go on writing the same file
+ * once the process was interrupted, filled by sj_index_writer_sync
+ */
+typedef struct {
+    int version;
+    int64_t offset; /// end of the records
+    int64_t count; /// number of indexes written
+    int dir_len; /// bytes of the block directory of a version 3 index
+    Index last; /// last index of a version 3 index, the block in progress goes on from it
+    int64_t last_step;
+} SJ_IndexWriterMark;
+
+/**
+ * Creates the index file filename, or a temporary file next to it unless flags contains SJ_INDEX_WRITE_IN_PLACE,
+ * and writes the header of an empty index of the given version.
+ * Returns 0 on success, -1 if the file could not be created and -5 if the version is unknown.
+ */
+int sj_index_writer_open(SJ_IndexWriter *w, const char *filename, int version, int flags);
+
+/**
+ * Appends a record to a version 0, 2 or 3 index, returns 0 or -1 on error.
+ * Version 3 encodes the records in blocks of SJ_INDEX_BLOCK_ENTRIES : the differences from the
+ * previous record as variable length integers, the first record of a block goes to the block directory.
+ */
+int sj_index_writer_add(SJ_IndexWriter *w, const Index *idx);
+
+/**
+ * Writes the count indexes of a version 1 index, column after column, returns 0 or -1 on error.
+ * get_index fills idx with the index i, the indexes need not be contiguous in memory.
+ */
+int sj_index_writer_columns(SJ_IndexWriter *w, int count, void (*get_index)(void *opaque, int i, Index *idx), void *opaque);
+
+/**
+ * Writes the records added so far then the header with the start values and, for versions 1 to 3,
+ * the number of indexes. The count is written last, by a single aligned write, so that a reader of
+ * an index written in place never counts an incomplete record. The block directory of a version 3
+ * index is written after the records, that version can only be read once the writer is closed.
+ * Returns 0 or -1 on error.
+ */
+int sj_index_writer_publish(SJ_IndexWriter *w);
+
+/**
+ * Publishes the index and closes the file, a temporary file is synced and renamed to the index file name.
+ * Returns 0 or -1 on error, the temporary file is then removed.
+ */
+int sj_index_writer_close(SJ_IndexWriter *w);
+
+/**
+ * Publishes the index and flushes the file to the disk, mark is set to the position reached.
+ * The records written so far survive an interruption of the process, see sj_index_writer_resume.
+ * Returns 0 or -1 on error.
+ */
+int sj_index_writer_sync(SJ_IndexWriter *w, SJ_IndexWriterMark *mark);
+
+/**
+ * Reopens the file left by an interrupted writer, tmpname or filename itself if tmpname is NULL,
+ * and drops what was written after mark. dir is the block directory of a version 3 index when
+ * mark was taken, mark->dir_len bytes, the file no longer holds it once records were added.
+ * The start values are set by the caller as after sj_index_writer_open.
+ * Returns 0, -1 if the file could not be reopened or -5 if the version is unknown.
+ */
+int sj_index_writer_resume(SJ_IndexWriter *w, const char *filename, const char *tmpname,
+                           const SJ_IndexWriterMark *mark, const uint8_t *dir);
+
+/**
+ * Closes the file without completing it, a temporary file is removed.
+ */
+void sj_index_writer_abort(SJ_IndexWriter *w);
+
+/**
+ * Closes the file without completing nor removing it, what was synced can be resumed with sj_index_writer_resume.
+ */
+void sj_index_writer_release(SJ_IndexWriter *w);
+
+#endif /* SJ_INDEX_WRITER_H */
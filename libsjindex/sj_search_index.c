@@ -3,121 +3,1420 @@
  * the PES offset of a frame given an Index file and a time reference
  *
  */
+#define _XOPEN_SOURCE 600
 #include <ffmpeg/avformat.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "indexer.h"
 #include "sj_search_index.h"
 
 #define INDEX_SIZE 29
 #define HEADER_SIZE 29
-static av_always_inline int read_index(Index *read_idx, ByteIOContext *seek_pb)
+#define COLUMNS_HEADER_SIZE 64
+#define INDEX_MAGIC 0x534A2D494E444558LL
+#define BLOCK_DIR_ENTRY_SIZE 36
+
+/*
+ * little endian accessors, used to read the header and the records
+ * straight from a mapped index file
+ */
+static av_always_inline uint32_t sj_rl32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static av_always_inline uint64_t sj_rl64(const uint8_t *p)
+{
+    return sj_rl32(p) | ((uint64_t)sj_rl32(p + 4) << 32);
+}
+
+/*
+ * timecodes are compared as a packed 32 bits key : hours, minutes, seconds, frames
+ * from the most significant byte down, which sorts like the hhmmssff search value
+ */
+static av_always_inline uint32_t timecode_pack(Timecode tc)
+{
+    return (uint8_t)tc.hours << 24 | (uint8_t)tc.minutes << 16 | (uint8_t)tc.seconds << 8 | (uint8_t)tc.frames;
+}
+
+static av_always_inline void timecode_unpack(Timecode *tc, uint32_t key)
+{
+    tc->hours = key >> 24;
+    tc->minutes = key >> 16;
+    tc->seconds = key >> 8;
+    tc->frames = key;
+}
+
+/*
+ * version 3 stores the indexes in blocks, the directory entry of a block gives its file offset and
+ * the first index : offset (0), pts (8), dts (16), pes offset (24), packed timecode (32)
+ */
+static av_always_inline const uint8_t *block_dir_entry(const SJ_IndexContext *sj_ic, int block)
+{
+    return sj_ic->block_dir + (size_t)block * BLOCK_DIR_ENTRY_SIZE;
+}
+
+static av_always_inline int block_num(const SJ_IndexContext *sj_ic)
+{
+    return ((sj_ic->index_num - 1) >> sj_ic->block_bits) + 1;
+}
+
+static av_always_inline int get_varint(const uint8_t **p, const uint8_t *end, int64_t *v)
+{
+    uint64_t u = 0;
+    int shift = 0;
+
+    do {
+        if (*p >= end || shift > 63)
+            return -1;
+        u |= (uint64_t)(**p & 0x7f) << shift;
+        shift += 7;
+    } while (*(*p)++ & 0x80);
+    *v = u >> 1 ^ -(u & 1);
+    return 0;
+}
+
+// number of indexes in a block, the last one can be partial
+static av_always_inline int block_size(const SJ_IndexContext *sj_ic, int block)
+{
+    return FFMIN(1 << sj_ic->block_bits, sj_ic->index_num - (block << sj_ic->block_bits));
+}
+
+// file offsets of the data of a block from the directory at dir, -1 if the directory is corrupt
+static int block_extent(const SJ_IndexContext *sj_ic, const uint8_t *dir, int block, uint64_t *start, uint64_t *end)
+{
+    dir += (size_t)block * BLOCK_DIR_ENTRY_SIZE;
+    *start = sj_rl64(dir);
+    *end = block + 1 < block_num(sj_ic) ? sj_rl64(dir + BLOCK_DIR_ENTRY_SIZE) : sj_ic->block_dir_offset;
+    if (*start < COLUMNS_HEADER_SIZE || *start > *end || *end > sj_ic->block_dir_offset)
+        return -1;
+    return 0;
+}
+
+/*
+ * decodes a block of a version 3 index into indexes, dir is the block directory and data
+ * the file content from offset data_offset, up to the end of the block at least.
+ * Each index is coded from the previous one as written by sj_index_writer_add.
+ * Returns -1 if the block is corrupt, the indexes it could not decode are cleared.
+ */
+static int decode_block(const SJ_IndexContext *sj_ic, const uint8_t *dir, const uint8_t *data, uint64_t data_offset,
+                        int block, Index *indexes)
+{
+    int num = block_size(sj_ic, block);
+    uint64_t start, end;
+    const uint8_t *p, *p_end;
+    uint32_t tc;
+    uint64_t step = 0;
+    Index idx;
+    int i;
+
+    if (block_extent(sj_ic, dir, block, &start, &end) < 0 || start < data_offset) {
+        memset(indexes, 0, num * sizeof(Index));
+        return -1;
+    }
+    p = data + (start - data_offset);
+    p_end = data + (end - data_offset);
+    dir += (size_t)block * BLOCK_DIR_ENTRY_SIZE;
+    tc = sj_rl32(dir + 32);
+    idx.pts = sj_rl64(dir + 8);
+    idx.dts = sj_rl64(dir + 16);
+    idx.pes_offset = sj_rl64(dir + 24);
+    for (i = 0; i < num; i++) {
+        int64_t step_diff, delay_diff, pes_diff;
+        if (p >= p_end)
+            break;
+        idx.pic_type = *p++;
+        if (i) {
+            uint64_t delay = (uint64_t)idx.dts - idx.pts;
+            if (get_varint(&p, p_end, &step_diff) < 0 || get_varint(&p, p_end, &delay_diff) < 0 ||
+                get_varint(&p, p_end, &pes_diff) < 0)
+                break;
+            step += step_diff;
+            idx.pts = (uint64_t)idx.pts + step;
+            idx.dts = (uint64_t)idx.pts + delay + delay_diff;
+            idx.pes_offset = (uint64_t)idx.pes_offset + pes_diff;
+            if (idx.pic_type & 0x80) {
+                tc++;
+            } else {
+                if (p_end - p < 4)
+                    break;
+                tc = sj_rl32(p);
+                p += 4;
+            }
+            idx.pic_type &= 0x7f;
+        }
+        timecode_unpack(&idx.timecode, tc);
+        indexes[i] = idx;
+    }
+    if (i < num) {
+        memset(indexes + i, 0, (num - i) * sizeof(Index));
+        return -1;
+    }
+    return 0;
+}
+
+static const Index *block_entry(const SJ_IndexContext *sj_ic, int pos)
+{
+    int block = pos >> sj_ic->block_bits;
+
+    if (!sj_ic->block_decoded[block]) {
+        // a corrupt block reads as empty indexes
+        decode_block(sj_ic, sj_ic->block_dir, sj_ic->map, 0, block, sj_ic->block_indexes + ((size_t)block << sj_ic->block_bits));
+        sj_ic->block_decoded[block] = 1;
+    }
+    return &sj_ic->block_indexes[pos];
+}
+
+/*
+ * version 0 record layout : pts (0), dts (8), pes offset (16), picture type (24),
+ * frames (25), seconds (26), minutes (27), hours (28)
+ */
+static av_always_inline void parse_record(const uint8_t *rec, Index *idx)
+{
+    idx->pts = sj_rl64(rec);
+    idx->dts = sj_rl64(rec + 8);
+    idx->pes_offset = sj_rl64(rec + 16);
+    idx->pic_type = rec[24];
+    idx->timecode.frames = rec[25];
+    idx->timecode.seconds = rec[26];
+    idx->timecode.minutes = rec[27];
+    idx->timecode.hours = rec[28];
+}
+
+// offset of the first record of a version 0 or 2 index
+static av_always_inline int records_offset(int version)
+{
+    return version == 2 ? COLUMNS_HEADER_SIZE : HEADER_SIZE;
+}
+
+#define PAGE_BITS 8 // indexes per page of a lazily loaded version 0 to 2 index, the pages of version 3 are its blocks
+#define PAGE_CACHE_SIZE 64 // most pages cached
+#define PAGE_CACHE_BYTES (1 << 20) // fewer pages are cached when they are large
+
+struct SJ_IndexPages {
+    int fd;
+    uint8_t *dir; /// block directory of a version 3 index
+    uint8_t *buf; /// file data of the page being read
+    size_t buf_size;
+    Index **cache; /// slot_num pages allocated when first used, a page is cached in the slot page % slot_num
+    int *cached; /// page in each slot of the cache, -1 if none
+    int slot_num;
+    int64_t *first_pts; /// pts of the first index of each page, the sample of a version 0 to 2 index
+    uint32_t *first_tc; /// packed timecode of the first index of each page
+    uint8_t *sampled; /// set for the pages whose first keys are known
+};
+
+static int read_fully(int fd, void *buf, size_t size, off_t offset)
+{
+    while (size) {
+        ssize_t ret = pread(fd, buf, size, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        buf = (uint8_t *)buf + ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static uint8_t *page_buffer(struct SJ_IndexPages *pages, size_t size)
+{
+    if (size > pages->buf_size) {
+        uint8_t *buf = av_realloc(pages->buf, size);
+        if (!buf)
+            return NULL;
+        pages->buf = buf;
+        pages->buf_size = size;
+    }
+    return pages->buf;
+}
+
+/*
+ * reads a page of a lazily loaded index in indexes,
+ * returns -1 if it could not be read, the indexes are then cleared
+ */
+static int read_page(const SJ_IndexContext *sj_ic, int page, Index *indexes)
+{
+    struct SJ_IndexPages *pages = sj_ic->pages;
+    int num = block_size(sj_ic, page);
+    off_t first = (off_t)page << sj_ic->block_bits;
+    off_t n = sj_ic->index_num;
+    uint8_t *buf;
+    int i;
+
+    if (sj_ic->version == 3) {
+        uint64_t start, end;
+        if (block_extent(sj_ic, pages->dir, page, &start, &end) < 0 || !(buf = page_buffer(pages, end - start)) ||
+            read_fully(pages->fd, buf, end - start, start) < 0)
+            goto fail;
+        return decode_block(sj_ic, pages->dir, buf, start, page, indexes);
+    }
+    if (!(buf = page_buffer(pages, (size_t)num * INDEX_SIZE)))
+        goto fail;
+    if (sj_ic->version == 1) {
+        // a read per column
+        if (read_fully(pages->fd, buf, num * 8, COLUMNS_HEADER_SIZE + 8 * first) < 0)
+            goto fail;
+        for (i = 0; i < num; i++)
+            indexes[i].pts = sj_rl64(buf + 8 * i);
+        if (read_fully(pages->fd, buf, num * 8, COLUMNS_HEADER_SIZE + 8 * n + 8 * first) < 0)
+            goto fail;
+        for (i = 0; i < num; i++)
+            indexes[i].dts = sj_rl64(buf + 8 * i);
+        if (read_fully(pages->fd, buf, num * 8, COLUMNS_HEADER_SIZE + 16 * n + 8 * first) < 0)
+            goto fail;
+        for (i = 0; i < num; i++)
+            indexes[i].pes_offset = sj_rl64(buf + 8 * i);
+        if (read_fully(pages->fd, buf, num * 4, COLUMNS_HEADER_SIZE + 24 * n + 4 * first) < 0)
+            goto fail;
+        for (i = 0; i < num; i++)
+            timecode_unpack(&indexes[i].timecode, sj_rl32(buf + 4 * i));
+        if (read_fully(pages->fd, buf, num, COLUMNS_HEADER_SIZE + 28 * n + first) < 0)
+            goto fail;
+        for (i = 0; i < num; i++)
+            indexes[i].pic_type = buf[i];
+    } else {
+        off_t offset = records_offset(sj_ic->version) + first * INDEX_SIZE;
+        if (read_fully(pages->fd, buf, (size_t)num * INDEX_SIZE, offset) < 0)
+            goto fail;
+        for (i = 0; i < num; i++)
+            parse_record(buf + (size_t)i * INDEX_SIZE, &indexes[i]);
+    }
+    return 0;
+fail:
+    memset(indexes, 0, num * sizeof(Index));
+    return -1;
+}
+
+static const Index *page_entry(const SJ_IndexContext *sj_ic, int pos)
+{
+    static const Index no_index;
+    struct SJ_IndexPages *pages = sj_ic->pages;
+    int page = pos >> sj_ic->block_bits;
+    int slot = page % pages->slot_num;
+    Index *indexes = pages->cache[slot];
+
+    if (!indexes && !(indexes = pages->cache[slot] = av_malloc(sizeof(Index) << sj_ic->block_bits)))
+        return &no_index;
+    if (pages->cached[slot] != page) {
+        // a page that could not be read reads as empty indexes and is read again next time
+        pages->cached[slot] = read_page(sj_ic, page, indexes) < 0 ? -1 : page;
+        if (pages->cached[slot] >= 0 && pages->sampled) {
+            pages->first_pts[page] = indexes[0].pts;
+            pages->first_tc[page] = timecode_pack(indexes[0].timecode);
+            pages->sampled[page] = 1;
+        }
+    }
+    return &indexes[pos & ((1 << sj_ic->block_bits) - 1)];
+}
+
+// the indexes are decoded or read a block at a time, a search should touch as few blocks as possible
+static av_always_inline int blockwise(const SJ_IndexContext *sj_ic)
+{
+    return sj_ic->block_dir || sj_ic->pages;
+}
+
+// record of a mapped version 0 or 2 index, laid out as read by parse_record
+static av_always_inline const uint8_t *record_at(const SJ_IndexContext *sj_ic, int pos)
+{
+    return sj_ic->records + (size_t)pos * INDEX_SIZE;
+}
+
+static av_always_inline int64_t entry_pts(const SJ_IndexContext *sj_ic, int pos)
+{
+    if (sj_ic->indexes)
+        return sj_ic->indexes[pos].pts;
+    if (sj_ic->block_indexes)
+        return block_entry(sj_ic, pos)->pts;
+    if (sj_ic->pages)
+        return page_entry(sj_ic, pos)->pts;
+    if (sj_ic->pts_col)
+        return sj_rl64(sj_ic->pts_col + 8 * (size_t)pos);
+    return sj_rl64(record_at(sj_ic, pos));
+}
+
+static av_always_inline int64_t entry_dts(const SJ_IndexContext *sj_ic, int pos)
+{
+    if (sj_ic->indexes)
+        return sj_ic->indexes[pos].dts;
+    if (sj_ic->block_indexes)
+        return block_entry(sj_ic, pos)->dts;
+    if (sj_ic->pages)
+        return page_entry(sj_ic, pos)->dts;
+    if (sj_ic->pts_col)
+        return sj_rl64(sj_ic->dts_col + 8 * (size_t)pos);
+    return sj_rl64(record_at(sj_ic, pos) + 8);
+}
+
+static av_always_inline uint8_t entry_pic_type(const SJ_IndexContext *sj_ic, int pos)
+{
+    if (sj_ic->indexes)
+        return sj_ic->indexes[pos].pic_type;
+    if (sj_ic->block_indexes)
+        return block_entry(sj_ic, pos)->pic_type;
+    if (sj_ic->pages)
+        return page_entry(sj_ic, pos)->pic_type;
+    if (sj_ic->pts_col)
+        return sj_ic->type_col[pos];
+    return record_at(sj_ic, pos)[24];
+}
+
+static av_always_inline uint32_t entry_timecode(const SJ_IndexContext *sj_ic, int pos)
+{
+    if (sj_ic->indexes)
+        return timecode_pack(sj_ic->indexes[pos].timecode);
+    if (sj_ic->block_indexes)
+        return timecode_pack(block_entry(sj_ic, pos)->timecode);
+    if (sj_ic->pages)
+        return timecode_pack(page_entry(sj_ic, pos)->timecode);
+    if (sj_ic->pts_col)
+        return sj_rl32(sj_ic->tc_col + 4 * (size_t)pos);
+    const uint8_t *rec = record_at(sj_ic, pos);
+    return rec[28] << 24 | rec[27] << 16 | rec[26] << 8 | rec[25];
+}
+
+static av_always_inline void get_entry(const SJ_IndexContext *sj_ic, int pos, Index *idx)
+{
+    if (sj_ic->indexes) {
+        *idx = sj_ic->indexes[pos];
+    } else if (sj_ic->block_indexes) {
+        *idx = *block_entry(sj_ic, pos);
+    } else if (sj_ic->pages) {
+        *idx = *page_entry(sj_ic, pos);
+    } else if (sj_ic->pts_col) {
+        idx->pts = sj_rl64(sj_ic->pts_col + 8 * (size_t)pos);
+        idx->dts = sj_rl64(sj_ic->dts_col + 8 * (size_t)pos);
+        idx->pes_offset = sj_rl64(sj_ic->pes_col + 8 * (size_t)pos);
+        idx->pic_type = sj_ic->type_col[pos];
+        timecode_unpack(&idx->timecode, sj_rl32(sj_ic->tc_col + 4 * (size_t)pos));
+    } else {
+        parse_record(record_at(sj_ic, pos), idx);
+    }
+}
+
+#define READ_CHUNK (1 << 20) // bytes read at once when the whole index is read
+
+// reads the records of a version 0 or 2 index, a chunk at a time
+static int read_records(SJ_IndexContext *sj_ic, int fd, uint8_t *buf)
+{
+    int i, j, num;
+
+    for (i = 0; i < sj_ic->index_num; i += num) {
+        num = FFMIN(sj_ic->index_num - i, READ_CHUNK / INDEX_SIZE);
+        if (read_fully(fd, buf, (size_t)num * INDEX_SIZE, records_offset(sj_ic->version) + (off_t)i * INDEX_SIZE) < 0)
+            return -1;
+        for (j = 0; j < num; j++)
+            parse_record(buf + (size_t)j * INDEX_SIZE, &sj_ic->indexes[i + j]);
+    }
+    return 0;
+}
+
+/*
+ * version 1 stores every field in its own column, one after the other :
+ * pts, dts and pes offset (64 bits), packed timecode (32 bits), picture type (8 bits)
+ */
+static int read_columns(SJ_IndexContext *sj_ic, int fd, uint8_t *buf)
+{
+    static const int field_size[5] = { 8, 8, 8, 4, 1 };
+    off_t offset = COLUMNS_HEADER_SIZE;
+    int col, i, j, num;
+
+    for (col = 0; col < 5; col++) {
+        int size = field_size[col];
+        for (i = 0; i < sj_ic->index_num; i += num) {
+            num = FFMIN(sj_ic->index_num - i, READ_CHUNK / size);
+            if (read_fully(fd, buf, (size_t)num * size, offset + (off_t)i * size) < 0)
+                return -1;
+            for (j = 0; j < num; j++) {
+                Index *idx = &sj_ic->indexes[i + j];
+                const uint8_t *p = buf + j * size;
+                switch (col) {
+                case 0: idx->pts = sj_rl64(p); break;
+                case 1: idx->dts = sj_rl64(p); break;
+                case 2: idx->pes_offset = sj_rl64(p); break;
+                case 3: timecode_unpack(&idx->timecode, sj_rl32(p)); break;
+                case 4: idx->pic_type = *p; break;
+                }
+            }
+        }
+        offset += (off_t)sj_ic->index_num * size;
+    }
+    return 0;
+}
+
+static void map_columns(SJ_IndexContext *sj_ic, const uint8_t *base)
+{
+    size_t n = sj_ic->index_num;
+
+    sj_ic->pts_col = base;
+    sj_ic->dts_col = base + 8 * n;
+    sj_ic->pes_col = base + 16 * n;
+    sj_ic->tc_col = base + 24 * n;
+    sj_ic->type_col = base + 28 * n;
+}
+
+/*
+ * builds the key frame directory : the positions of all the I frames, in index order,
+ * so that the key frame of any frame is found with a binary search.
+ * The I frames from position from on are appended to the directory already built.
+ */
+static int build_key_frames(SJ_IndexContext *sj_ic, int from)
+{
+    int *key_frames;
+    int num = sj_ic->key_frame_num;
+    int i;
+
+    for (i = from; i < sj_ic->index_num; i++)
+        num += entry_pic_type(sj_ic, i) == FF_I_TYPE;
+    // the directory is allocated even without I frames so that it is not built again
+    key_frames = av_realloc(sj_ic->key_frames, FFMAX(num, 1) * sizeof(*key_frames));
+    if (!key_frames)
+        return -1;
+    sj_ic->key_frames = key_frames;
+    for (i = from; i < sj_ic->index_num; i++) {
+        if (entry_pic_type(sj_ic, i) == FF_I_TYPE)
+            key_frames[sj_ic->key_frame_num++] = i;
+    }
+    return 0;
+}
+
+typedef struct {
+    int64_t dts;
+    int pos;
+} DtsEntry;
+
+static int dts_entry_cmp(const void *e1, const void *e2)
+{
+    const DtsEntry *a = e1, *b = e2;
+    if (a->dts != b->dts)
+        return a->dts < b->dts ? -1 : 1;
+    return a->pos - b->pos;
+}
+
+/*
+ * indexes are in pts order, dts_order lists their positions in dts order
+ * and dts_keys the matching dts, so that a dts is found with a binary search
+ */
+static int build_dts_order(SJ_IndexContext *sj_ic)
+{
+    DtsEntry *entries = av_malloc(sj_ic->index_num * sizeof(*entries));
+
+    if (!entries)
+        return -1;
+    for (int i = 0; i < sj_ic->index_num; i++) {
+        entries[i].dts = entry_dts(sj_ic, i);
+        entries[i].pos = i;
+    }
+    qsort(entries, sj_ic->index_num, sizeof(*entries), dts_entry_cmp);
+
+    sj_ic->dts_keys = av_malloc(sj_ic->index_num * sizeof(*sj_ic->dts_keys));
+    sj_ic->dts_order = av_malloc(sj_ic->index_num * sizeof(*sj_ic->dts_order));
+    if (!sj_ic->dts_keys || !sj_ic->dts_order) {
+        av_freep(&sj_ic->dts_keys);
+        av_freep(&sj_ic->dts_order);
+        av_free(entries);
+        return -1;
+    }
+    for (int i = 0; i < sj_ic->index_num; i++) {
+        sj_ic->dts_keys[i] = entries[i].dts;
+        sj_ic->dts_order[i] = entries[i].pos;
+    }
+    av_free(entries);
+    return 0;
+}
+
+/*
+ * merges the dts of the indexes appended from position from into the dts order,
+ * from the back so that the existing entries are moved at most once
+ */
+static int extend_dts_order(SJ_IndexContext *sj_ic, int from)
+{
+    int n = sj_ic->index_num - from;
+    DtsEntry *entries = av_malloc(n * sizeof(*entries));
+    int64_t *keys;
+    int *order;
+    int i = from - 1, j = n - 1, k;
+
+    if (!entries)
+        return -1;
+    for (k = 0; k < n; k++) {
+        entries[k].dts = entry_dts(sj_ic, from + k);
+        entries[k].pos = from + k;
+    }
+    qsort(entries, n, sizeof(*entries), dts_entry_cmp);
+
+    keys = av_realloc(sj_ic->dts_keys, sj_ic->index_num * sizeof(*keys));
+    if (keys)
+        sj_ic->dts_keys = keys;
+    order = av_realloc(sj_ic->dts_order, sj_ic->index_num * sizeof(*order));
+    if (order)
+        sj_ic->dts_order = order;
+    if (!keys || !order) {
+        av_free(entries);
+        return -1;
+    }
+    // on equal dts the appended index has the higher position and goes last
+    for (k = sj_ic->index_num - 1; j >= 0; k--) {
+        if (i >= 0 && keys[i] > entries[j].dts) {
+            keys[k] = keys[i];
+            order[k] = order[i--];
+        } else {
+            keys[k] = entries[j].dts;
+            order[k] = entries[j--].pos;
+        }
+    }
+    av_free(entries);
+    return 0;
+}
+
+#define SEGMENT_MIN_SIZE 16
+
+// timecode as a number of frames since 00:00:00:00
+static av_always_inline int64_t timecode_frames(uint32_t key, int rate)
+{
+    return (((int64_t)(key >> 24) * 60 + ((key >> 16) & 0xff)) * 60 + ((key >> 8) & 0xff)) * rate + (key & 0xff);
+}
+
+static av_always_inline int64_t segment_value(const SJ_IndexContext *sj_ic, int pos, int mode)
+{
+    if (mode == SJ_INDEX_TIMECODE_SEARCH)
+        return timecode_frames(entry_timecode(sj_ic, pos), sj_ic->tc_rate);
+    return entry_pts(sj_ic, pos);
+}
+
+/*
+ * splits the index in runs where the value grows by a constant step,
+ * runs shorter than SEGMENT_MIN_SIZE are left to the binary search.
+ * The runs found from position start on are appended to the table.
+ */
+static int build_segment_table(SJ_IndexContext *sj_ic, int mode, SJ_IndexSegment **table, int *table_num, int start)
+{
+    SJ_IndexSegment *segments = *table;
+    int num = *table_num;
+    int size = FFMAX(num, 16); // a table is allocated for 16 segments and doubled when full
+
+    if (!segments) {
+        size = 16;
+        segments = av_malloc(size * sizeof(*segments));
+        if (!segments)
+            return -1;
+        *table = segments;
+    }
+    while (start < sj_ic->index_num - 1) {
+        int64_t value = segment_value(sj_ic, start, mode);
+        int64_t step = segment_value(sj_ic, start + 1, mode) - value;
+        int end = start + 1;
+
+        while (end + 1 < sj_ic->index_num && segment_value(sj_ic, end + 1, mode) - segment_value(sj_ic, end, mode) == step)
+            end++;
+        if (step > 0 && end - start + 1 >= SEGMENT_MIN_SIZE) {
+            if (num == size) {
+                SJ_IndexSegment *tmp = av_realloc(segments, 2 * size * sizeof(*segments));
+                if (!tmp)
+                    return -1;
+                *table = segments = tmp;
+                size *= 2;
+            }
+            segments[num].pos = start;
+            segments[num].num = end - start + 1;
+            segments[num].start = value;
+            segments[num].step = step;
+            *table_num = ++num;
+        }
+        start = end;
+    }
+    return 0;
+}
+
+// the timecode frame rate is not stored, the highest frame number of the indexes from to to tells it
+static int timecode_rate(const SJ_IndexContext *sj_ic, int from, int to)
+{
+    int rate = 0;
+
+    for (int i = from; i < to; i++)
+        rate = FFMAX(rate, entry_timecode(sj_ic, i) & 0xff);
+    return rate + 1;
+}
+
+static int build_segments(SJ_IndexContext *sj_ic)
+{
+    sj_ic->tc_rate = timecode_rate(sj_ic, 0, sj_ic->index_num);
+    if (build_segment_table(sj_ic, SJ_INDEX_PTS_SEARCH, &sj_ic->pts_segments, &sj_ic->pts_segment_num, 0) < 0 ||
+        build_segment_table(sj_ic, SJ_INDEX_TIMECODE_SEARCH, &sj_ic->tc_segments, &sj_ic->tc_segment_num, 0) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * continues the segment tables over the indexes appended from position from,
+ * the last segment is extended if it reached the previous end
+ */
+static int extend_segment_table(SJ_IndexContext *sj_ic, int mode, SJ_IndexSegment **table, int *table_num, int from)
+{
+    int start = from - 1;
+
+    if (*table_num && (*table)[*table_num - 1].pos + (*table)[*table_num - 1].num == from)
+        start = (*table)[--*table_num].pos;
+    return build_segment_table(sj_ic, mode, table, table_num, start);
+}
+
+static int extend_segments(SJ_IndexContext *sj_ic, int from)
+{
+    int rate = timecode_rate(sj_ic, from, sj_ic->index_num);
+
+    if (extend_segment_table(sj_ic, SJ_INDEX_PTS_SEARCH, &sj_ic->pts_segments, &sj_ic->pts_segment_num, from) < 0)
+        return -1;
+    // timecodes counted in frames at a lower rate are no longer valid
+    if (rate > sj_ic->tc_rate) {
+        sj_ic->tc_rate = rate;
+        sj_ic->tc_segment_num = 0;
+        from = 1;
+    }
+    return extend_segment_table(sj_ic, SJ_INDEX_TIMECODE_SEARCH, &sj_ic->tc_segments, &sj_ic->tc_segment_num, from);
+}
+
+/*
+ * the search tree keeps the timecode and pts keys in Eytzinger order (the layout of a
+ * binary heap, 1-based) : the first levels of every search share the same cache lines
+ * and the children of a node are next to each other, so they can be prefetched
+ * a few levels ahead. tree_pos maps a node back to its position in the index list.
+ */
+static int fill_search_tree(SJ_IndexContext *sj_ic, int pos, int node)
+{
+    if (node <= sj_ic->index_num) {
+        pos = fill_search_tree(sj_ic, pos, 2 * node);
+        sj_ic->tree_tc[node] = entry_timecode(sj_ic, pos);
+        sj_ic->tree_pts[node] = entry_pts(sj_ic, pos);
+        sj_ic->tree_pos[node] = pos++;
+        pos = fill_search_tree(sj_ic, pos, 2 * node + 1);
+    }
+    return pos;
+}
+
+static int build_search_tree(SJ_IndexContext *sj_ic)
+{
+    size_t n = sj_ic->index_num + 1;
+
+    sj_ic->tree_tc = av_malloc(n * sizeof(*sj_ic->tree_tc));
+    sj_ic->tree_pts = av_malloc(n * sizeof(*sj_ic->tree_pts));
+    sj_ic->tree_pos = av_malloc(n * sizeof(*sj_ic->tree_pos));
+    if (!sj_ic->tree_tc || !sj_ic->tree_pts || !sj_ic->tree_pos)
+        return -1;
+    // the position of the past the end node, returned when every key is lower
+    sj_ic->tree_pos[0] = sj_ic->index_num;
+    fill_search_tree(sj_ic, 0, 1);
+    return 0;
+}
+
+/*
+ * parses the header found in buf (at least COLUMNS_HEADER_SIZE bytes, or the whole file if smaller)
+ * and sets the version, start values and number of indexes of the context
+ */
+static int parse_header(SJ_IndexContext *sj_ic, const uint8_t *buf, int64_t file_size)
+{
+    if (file_size < HEADER_SIZE || sj_rl64(buf) != INDEX_MAGIC) {
+        // not an index file
+        return -2;
+    }
+    sj_ic->version = buf[8];
+    sj_ic->start_pts = sj_rl64(buf + 9);
+    sj_ic->start_dts = sj_rl64(buf + 17);
+    sj_ic->start_timecode.frames = buf[25];
+    sj_ic->start_timecode.seconds = buf[26];
+    sj_ic->start_timecode.minutes = buf[27];
+    sj_ic->start_timecode.hours = buf[28];
+
+    if (sj_ic->version == 0) {
+        sj_ic->size = file_size - HEADER_SIZE;
+        sj_ic->index_num = (sj_ic->size / INDEX_SIZE);
+    } else if (sj_ic->version == 1 || sj_ic->version == 2) {
+        if (file_size < COLUMNS_HEADER_SIZE) {
+            return -2;
+        }
+        // version 2 files can be longer while records are appended, only the counted ones are complete
+        uint64_t count = sj_rl64(buf + 32);
+        sj_ic->size = file_size - COLUMNS_HEADER_SIZE;
+        if (count > INT_MAX || count * INDEX_SIZE > sj_ic->size) {
+            // truncated index
+            return -2;
+        }
+        sj_ic->index_num = count;
+    } else if (sj_ic->version == 3) {
+        if (file_size < COLUMNS_HEADER_SIZE) {
+            return -2;
+        }
+        uint64_t count = sj_rl64(buf + 32);
+        uint32_t block_size = sj_rl32(buf + 40);
+        uint64_t dir_offset = sj_rl64(buf + 48);
+        sj_ic->size = file_size - COLUMNS_HEADER_SIZE;
+        if (count > INT_MAX || !block_size || block_size > 1 << 12 || (block_size & (block_size - 1)) ||
+            dir_offset < COLUMNS_HEADER_SIZE || dir_offset > file_size ||
+            (count + block_size - 1) / block_size * BLOCK_DIR_ENTRY_SIZE > file_size - dir_offset) {
+            // truncated index
+            return -2;
+        }
+        sj_ic->index_num = count;
+        sj_ic->block_bits = __builtin_ctz(block_size);
+        sj_ic->block_dir_offset = dir_offset;
+    } else {
+        // unknown version
+        return -5;
+    }
+
+    if (!sj_ic->index_num) {
+        // empty index
+        return -4;
+    }
+    return 0;
+}
+
+static int index_map(char *filename, SJ_IndexContext *sj_ic)
+{
+    struct stat st;
+    uint8_t *map;
+    int ret;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        // file could not be open
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < HEADER_SIZE) {
+        close(fd);
+        return -2;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid once the descriptor is closed
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -3;
+    }
+
+    sj_ic->map = map;
+    sj_ic->map_size = st.st_size;
+    if ((ret = parse_header(sj_ic, map, st.st_size)) < 0) {
+        sj_index_unload(sj_ic);
+        return ret;
+    }
+    if (sj_ic->version == 1) {
+        map_columns(sj_ic, map + COLUMNS_HEADER_SIZE);
+    } else if (sj_ic->version == 3) {
+        // the pages of the blocks never decoded are not touched
+        sj_ic->block_dir = map + sj_ic->block_dir_offset;
+        sj_ic->block_indexes = av_malloc(sj_ic->index_num * sizeof(Index));
+        sj_ic->block_decoded = av_mallocz(block_num(sj_ic));
+        if (!sj_ic->block_indexes || !sj_ic->block_decoded) {
+            sj_index_unload(sj_ic);
+            return -1;
+        }
+    } else {
+        sj_ic->records = map + records_offset(sj_ic->version);
+    }
+    return 0;
+}
+
+/*
+ * reads the header, and the block directory of a version 3 index, the pages are read as they are needed.
+ * The page cache and the sample are allocated once, their memory is only touched when used.
+ */
+static int index_open_lazy(char *filename, SJ_IndexContext *sj_ic)
+{
+    uint8_t header[COLUMNS_HEADER_SIZE];
+    struct SJ_IndexPages *pages;
+    struct stat st;
+    int ret, num, i;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        // file could not be open
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || read_fully(fd, header, FFMIN(st.st_size, COLUMNS_HEADER_SIZE), 0) < 0) {
+        close(fd);
+        return -1;
+    }
+    if ((ret = parse_header(sj_ic, header, st.st_size)) < 0) {
+        close(fd);
+        return ret;
+    }
+    pages = sj_ic->pages = av_mallocz(sizeof(*pages));
+    if (!pages) {
+        close(fd);
+        return -1;
+    }
+    pages->fd = fd;
+    if (sj_ic->version != 3)
+        sj_ic->block_bits = PAGE_BITS;
+    num = block_num(sj_ic);
+    pages->slot_num = FFMAX(FFMIN(PAGE_CACHE_BYTES / (sizeof(Index) << sj_ic->block_bits), PAGE_CACHE_SIZE), 4);
+    pages->cache = av_mallocz(pages->slot_num * sizeof(*pages->cache));
+    pages->cached = av_malloc(pages->slot_num * sizeof(*pages->cached));
+    if (!pages->cache || !pages->cached)
+        goto fail;
+    for (i = 0; i < pages->slot_num; i++)
+        pages->cached[i] = -1;
+    if (sj_ic->version == 3) {
+        // the directory is a sample of the keys stored in the file
+        pages->dir = av_malloc(num * BLOCK_DIR_ENTRY_SIZE);
+        if (!pages->dir || read_fully(fd, pages->dir, (size_t)num * BLOCK_DIR_ENTRY_SIZE, sj_ic->block_dir_offset) < 0)
+            goto fail;
+        sj_ic->block_dir = pages->dir;
+    } else {
+        pages->first_pts = av_malloc(num * sizeof(*pages->first_pts));
+        pages->first_tc = av_malloc(num * sizeof(*pages->first_tc));
+        pages->sampled = av_mallocz(num);
+        if (!pages->first_pts || !pages->first_tc || !pages->sampled)
+            goto fail;
+    }
+    return 0;
+fail:
+    sj_index_unload(sj_ic);
+    return -1;
+}
+
+int sj_index_load(char *filename, SJ_IndexContext *sj_ic)
+{
+    return sj_index_load2(filename, sj_ic, 0);
+}
+
+// decodes every block of a version 3 index
+static int read_blocks(SJ_IndexContext *sj_ic, int fd, int64_t file_size)
+{
+    uint8_t *data = av_malloc(file_size);
+    int ret = 0;
+
+    if (!data)
+        return -1;
+    if (read_fully(fd, data, file_size, 0) < 0) {
+        av_free(data);
+        return -2;
+    }
+    for (int i = 0; i < block_num(sj_ic) && !ret; i++) {
+        if (decode_block(sj_ic, data + sj_ic->block_dir_offset, data, 0, i, sj_ic->indexes + ((size_t)i << sj_ic->block_bits)) < 0)
+            ret = -2;
+    }
+    av_free(data);
+    return ret;
+}
+
+/*
+ * reads the whole index with pread, without going through the libavformat protocols :
+ * no global state is touched and any number of threads can load indexes at once
+ */
+static int index_read(char *filename, SJ_IndexContext *sj_ic)
+{
+    uint8_t header[COLUMNS_HEADER_SIZE];
+    uint8_t *buf = NULL;
+    struct stat st;
+    int ret;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        // file could not be open
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || read_fully(fd, header, FFMIN(st.st_size, COLUMNS_HEADER_SIZE), 0) < 0) {
+        close(fd);
+        return -1;
+    }
+    if ((ret = parse_header(sj_ic, header, st.st_size)) < 0) {
+        close(fd);
+        return ret;
+    }
+
+    sj_ic->indexes = av_malloc(sj_ic->index_num * sizeof(Index));
+    if (sj_ic->version != 3)
+        buf = av_malloc(READ_CHUNK);
+    if (!sj_ic->indexes || (sj_ic->version != 3 && !buf)) {
+        ret = -1;
+    } else if (sj_ic->version == 1) {
+        ret = read_columns(sj_ic, fd, buf);
+    } else if (sj_ic->version == 3) {
+        ret = read_blocks(sj_ic, fd, st.st_size);
+    } else {
+        ret = read_records(sj_ic, fd, buf);
+    }
+    av_free(buf);
+    close(fd);
+    if (ret < 0) {
+        sj_index_unload(sj_ic);
+        return ret;
+    }
+
+    if (build_key_frames(sj_ic, 0) < 0 || build_segments(sj_ic) < 0 || build_dts_order(sj_ic) < 0) {
+        sj_index_unload(sj_ic);
+        return -1;
+    }
+    return 0;
+}
+
+int sj_index_load2(char *filename, SJ_IndexContext *sj_ic, int flags)
+{
+    int ret;
+
+    memset(sj_ic, 0, sizeof(*sj_ic));
+    if (flags & SJ_INDEX_LOAD_LAZY) {
+        ret = index_open_lazy(filename, sj_ic);
+    } else if (flags & SJ_INDEX_LOAD_MMAP) {
+        ret = index_map(filename, sj_ic);
+    } else {
+        ret = index_read(filename, sj_ic);
+    }
+    if (ret < 0)
+        return ret;
+
+    sj_ic->flags = flags;
+    sj_ic->filename = av_strdup(filename);
+    if (!sj_ic->filename || ((flags & SJ_INDEX_LOAD_EYTZINGER) && !sj_ic->pages && build_search_tree(sj_ic) < 0)) {
+        sj_index_unload(sj_ic);
+        return -1;
+    }
+    return 0;
+}
+
+int sj_index_unload(SJ_IndexContext *sj_ic)
 {
-    read_idx->pts = get_le64(seek_pb);
-    read_idx->dts = get_le64(seek_pb);
-    read_idx->pes_offset = get_le64(seek_pb);
-    read_idx->pic_type = get_byte(seek_pb);
-    read_idx->timecode.frames = get_byte(seek_pb);
-    read_idx->timecode.seconds = get_byte(seek_pb);
-    read_idx->timecode.minutes = get_byte(seek_pb);
-    read_idx->timecode.hours = get_byte(seek_pb);
+    if (sj_ic->map) {
+        munmap((void *)sj_ic->map, sj_ic->map_size);
+    }
+    av_free(sj_ic->filename);
+    av_free(sj_ic->indexes);
+    av_free(sj_ic->key_frames);
+    av_free(sj_ic->tree_tc);
+    av_free(sj_ic->tree_pts);
+    av_free(sj_ic->tree_pos);
+    av_free(sj_ic->pts_segments);
+    av_free(sj_ic->tc_segments);
+    av_free(sj_ic->dts_keys);
+    av_free(sj_ic->dts_order);
+    av_free(sj_ic->block_indexes);
+    av_free(sj_ic->block_decoded);
+    if (sj_ic->pages) {
+        close(sj_ic->pages->fd);
+        av_free(sj_ic->pages->dir);
+        av_free(sj_ic->pages->buf);
+        for (int i = 0; sj_ic->pages->cache && i < sj_ic->pages->slot_num; i++)
+            av_free(sj_ic->pages->cache[i]);
+        av_free(sj_ic->pages->cache);
+        av_free(sj_ic->pages->cached);
+        av_free(sj_ic->pages->first_pts);
+        av_free(sj_ic->pages->first_tc);
+        av_free(sj_ic->pages->sampled);
+        av_free(sj_ic->pages);
+    }
+    memset(sj_ic, 0, sizeof(*sj_ic));
     return 0;
 }
 
-int sj_index_load(char *filename, SJ_IndexContext *sj_ic)
+// loads the file again with the same flags, the context is left empty on error
+static int index_reload(SJ_IndexContext *sj_ic)
 {
-    ByteIOContext pb;
-    register_protocol(&file_protocol);
+    char *filename = sj_ic->filename;
+    int flags = sj_ic->flags;
+    int ret;
 
-    if (url_fopen(&pb, filename, URL_RDONLY) < 0) {
-        // file could not be open
+    sj_ic->filename = NULL;
+    sj_index_unload(sj_ic);
+    ret = sj_index_load2(filename, sj_ic, flags);
+    av_free(filename);
+    return ret < 0 ? ret : sj_ic->index_num;
+}
+
+// grows the sample of a lazily loaded index to index_num, the indexes before from were read already
+static int extend_pages(SJ_IndexContext *sj_ic, int from)
+{
+    struct SJ_IndexPages *pages = sj_ic->pages;
+    int num = block_num(sj_ic);
+    int last = (from - 1) >> sj_ic->block_bits;
+    int64_t *first_pts = av_realloc(pages->first_pts, num * sizeof(*first_pts));
+    uint32_t *first_tc;
+    uint8_t *sampled;
+
+    if (!first_pts)
         return -1;
-    }
-    sj_ic->size = url_fsize(&pb) - HEADER_SIZE;
-    sj_ic->index_num = (sj_ic->size / INDEX_SIZE);
-    sj_ic->indexes = av_malloc(sj_ic->index_num * sizeof(Index));
+    pages->first_pts = first_pts;
+    if (!(first_tc = av_realloc(pages->first_tc, num * sizeof(*first_tc))))
+        return -1;
+    pages->first_tc = first_tc;
+    if (!(sampled = av_realloc(pages->sampled, num)))
+        return -1;
+    pages->sampled = sampled;
+    memset(sampled + last + 1, 0, num - last - 1);
+    // the last page was partial, its first keys are still valid
+    if (pages->cached[last % pages->slot_num] == last)
+        pages->cached[last % pages->slot_num] = -1;
+    return 0;
+}
 
-    int64_t magic = get_le64(&pb);
-    if (magic != 0x534A2D494E444558LL) {
-        // not an index file
-        url_fclose(&pb);
-        return -2;
-    }
-    sj_ic->version = get_byte(&pb);
-    sj_ic->start_pts = get_le64(&pb);
-    sj_ic->start_dts = get_le64(&pb);
-    sj_ic->start_timecode.frames = get_byte(&pb);
-    sj_ic->start_timecode.seconds = get_byte(&pb);
-    sj_ic->start_timecode.minutes = get_byte(&pb);
-    sj_ic->start_timecode.hours = get_byte(&pb);
+// reads or maps the records from position from up to index_num, the file is size bytes long
+static int index_append(SJ_IndexContext *sj_ic, int fd, int64_t size, int from)
+{
+    size_t len = (size_t)(sj_ic->index_num - from) * INDEX_SIZE;
+    off_t offset = records_offset(sj_ic->version) + (off_t)from * INDEX_SIZE;
+    uint8_t *buf;
 
-    if (!sj_ic->index_num) {
-        // empty index
-        url_fclose(&pb);
-        return -4;
+    if (sj_ic->pages)
+        return extend_pages(sj_ic, from);
+    if (sj_ic->map) {
+        buf = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (buf == MAP_FAILED)
+            return -3;
+        munmap((void *)sj_ic->map, sj_ic->map_size);
+        sj_ic->map = buf;
+        sj_ic->map_size = size;
+        sj_ic->records = buf + records_offset(sj_ic->version);
+        return 0;
     }
 
-    for(int i = 0; i < sj_ic->index_num; i++) {
-        read_index(&sj_ic->indexes[i], &pb);
+    Index *indexes = av_realloc(sj_ic->indexes, sj_ic->index_num * sizeof(Index));
+    if (!indexes)
+        return -1;
+    sj_ic->indexes = indexes;
+    buf = av_malloc(len);
+    if (!buf || read_fully(fd, buf, len, offset) < 0) {
+        av_free(buf);
+        return -1;
     }
-    url_fclose(&pb);
+    for (int i = from; i < sj_ic->index_num; i++)
+        parse_record(buf + (size_t)(i - from) * INDEX_SIZE, &indexes[i]);
+    av_free(buf);
     return 0;
 }
 
-int sj_index_unload(SJ_IndexContext *sj_ic)
+// drops the lookup structures, they are built again on their first use
+static void drop_lookups(SJ_IndexContext *sj_ic)
 {
-    free(sj_ic->indexes);
-    memset(sj_ic, 0, sizeof(*sj_ic));
-    return 0;
+    av_freep(&sj_ic->key_frames);
+    sj_ic->key_frame_num = 0;
+    av_freep(&sj_ic->pts_segments);
+    av_freep(&sj_ic->tc_segments);
+    sj_ic->pts_segment_num = sj_ic->tc_segment_num = 0;
+    av_freep(&sj_ic->dts_keys);
+    av_freep(&sj_ic->dts_order);
+}
+
+int sj_index_refresh(SJ_IndexContext *sj_ic)
+{
+    SJ_IndexContext header;
+    uint8_t buf[COLUMNS_HEADER_SIZE];
+    struct stat st;
+    int from = sj_ic->index_num;
+    int64_t old_size = sj_ic->size;
+    int ret;
+    int fd = open(sj_ic->filename, O_RDONLY);
+
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    if (fstat(fd, &st) < 0 || read_fully(fd, buf, FFMIN(st.st_size, COLUMNS_HEADER_SIZE), 0) < 0) {
+        close(fd);
+        return -1;
+    }
+    ret = parse_header(&header, buf, st.st_size);
+    // only version 0 and 2 files grow by appending records, any other change is loaded again
+    if (ret < 0 || header.version != sj_ic->version || (header.version != 0 && header.version != 2) ||
+        header.index_num < from) {
+        close(fd);
+        return index_reload(sj_ic);
+    }
+    sj_ic->start_pts = header.start_pts;
+    sj_ic->start_dts = header.start_dts;
+    sj_ic->start_timecode = header.start_timecode;
+    if (header.index_num == from) {
+        close(fd);
+        return 0;
+    }
+
+    sj_ic->size = header.size;
+    sj_ic->index_num = header.index_num;
+    ret = index_append(sj_ic, fd, st.st_size, from);
+    close(fd);
+    if (ret < 0)
+        goto fail;
+    // the structures of a mapped index that were not built yet still are on their first use
+    if ((sj_ic->key_frames && build_key_frames(sj_ic, from) < 0) ||
+        (sj_ic->pts_segments && extend_segments(sj_ic, from) < 0) ||
+        (sj_ic->dts_order && extend_dts_order(sj_ic, from) < 0))
+        goto fail;
+    if (sj_ic->tree_pos) {
+        av_freep(&sj_ic->tree_tc);
+        av_freep(&sj_ic->tree_pts);
+        av_freep(&sj_ic->tree_pos);
+        if (build_search_tree(sj_ic) < 0)
+            goto fail;
+    }
+    return sj_ic->index_num - from;
+fail:
+    // the indexes loaded before stay searchable, the next refresh reads the new ones again
+    sj_ic->index_num = from;
+    sj_ic->size = old_size;
+    drop_lookups(sj_ic);
+    return ret < 0 ? ret : -1;
 }
 
-static av_always_inline uint64_t get_search_value(Index idx, int mode)
+static av_always_inline uint64_t get_search_value(const SJ_IndexContext *sj_ic, int pos, int mode)
 {
     if (mode == SJ_INDEX_TIMECODE_SEARCH) {
-        return idx.timecode.hours * 1000000 + idx.timecode.minutes * 10000 + idx.timecode.seconds * 100 + idx.timecode.frames;
+        return entry_timecode(sj_ic, pos);
     }
     else if (mode == SJ_INDEX_PTS_SEARCH){
-        return idx.pts;
+        return entry_pts(sj_ic, pos);
     }
     else if (mode == SJ_INDEX_DTS_SEARCH){
-        return idx.dts;
+        return entry_dts(sj_ic, pos);
     }
     return -1; // invalid search mode
 }
 
-static int find_I_frame(Index *key_frame, SJ_IndexContext sj_ic, int index_pos)
+// converts a search value to the key returned by get_search_value
+static av_always_inline uint64_t get_search_key(uint64_t search_time, int mode)
 {
-    // if the next I_frame has a dts inferior to the searched dts then this I_frame is the related key_frame
-    for (int i = index_pos; i < sj_ic.index_num; i++){
-        if (sj_ic.indexes[i].pic_type == FF_I_TYPE && sj_ic.indexes[i].dts < sj_ic.indexes[index_pos].dts) {
-            *key_frame = sj_ic.indexes[i];
-            return 0;
-        }
+    if (mode == SJ_INDEX_TIMECODE_SEARCH) {
+        return (search_time / 1000000) << 24 | (search_time / 10000 % 100) << 16 | (search_time / 100 % 100) << 8 | search_time % 100;
+    }
+    return search_time;
+}
+
+/*
+ * search tree descents, one per key type so that the loop is a compare and a shift.
+ * They return the first position whose key is greater than (upper) or not lower than
+ * (!upper) key, the prefetch pulls the line holding the nodes a few levels below.
+ */
+static int tree_bound_tc(const SJ_IndexContext *sj_ic, uint32_t key, int upper)
+{
+    const uint32_t *tree = sj_ic->tree_tc;
+    unsigned node = 1;
+
+    while (node <= (unsigned)sj_ic->index_num) {
+        // 16 keys per cache line, four levels down
+        __builtin_prefetch(tree + 16 * (size_t)node);
+        node = 2 * node + (tree[node] < key) + (upper & (tree[node] == key));
+    }
+    // the answer is the last node where the descent went left
+    node >>= __builtin_ffs(~node);
+    return sj_ic->tree_pos[node];
+}
+
+static int tree_bound_pts(const SJ_IndexContext *sj_ic, uint64_t key, int upper)
+{
+    const uint64_t *tree = sj_ic->tree_pts;
+    unsigned node = 1;
+
+    while (node <= (unsigned)sj_ic->index_num) {
+        // 8 keys per cache line, three levels down
+        __builtin_prefetch(tree + 8 * (size_t)node);
+        node = 2 * node + (tree[node] < key) + (upper & (tree[node] == key));
+    }
+    node >>= __builtin_ffs(~node);
+    return sj_ic->tree_pos[node];
+}
+
+static av_always_inline int tree_bound(const SJ_IndexContext *sj_ic, uint64_t key, int mode, int upper)
+{
+    if (mode == SJ_INDEX_TIMECODE_SEARCH) {
+        // out of the range of any packed timecode
+        if (key >> 32)
+            return sj_ic->index_num;
+        return tree_bound_tc(sj_ic, key, upper);
     }
-    // otherwise, look before the searched frame
-    for (int i = index_pos; i >= 0; i--) {
-        if (sj_ic.indexes[i].pic_type == FF_I_TYPE) {
-            *key_frame = sj_ic.indexes[i];
-            return 0;
+    return tree_bound_pts(sj_ic, key, upper);
+}
+
+#define KEY_FRAME_SCAN 1024 // indexes read on each side of a frame for its key frame before the directory is built
+
+/*
+ * returns the position of the key frame needed to decode the frame at index_pos,
+ * -1 if there is none and -2 if the key frame directory could not be built
+ */
+static int find_key_frame(SJ_IndexContext *sj_ic, int index_pos)
+{
+    int low = 0, high;
+    int next, prev, end;
+
+    if (!sj_ic->key_frames && blockwise(sj_ic)) {
+        // the I frames around index_pos are usually in the blocks next to it, the whole index is not read
+        end = FFMIN(sj_ic->index_num, index_pos + KEY_FRAME_SCAN);
+        for (next = index_pos; next < end && entry_pic_type(sj_ic, next) != FF_I_TYPE; next++)
+            ;
+        if (next < end || end == sj_ic->index_num) {
+            if (next < sj_ic->index_num && entry_dts(sj_ic, next) < entry_dts(sj_ic, index_pos))
+                return next;
+            if (next == index_pos)
+                return index_pos;
+            end = FFMAX(index_pos - KEY_FRAME_SCAN, 0);
+            for (prev = index_pos - 1; prev >= end && entry_pic_type(sj_ic, prev) != FF_I_TYPE; prev--)
+                ;
+            if (prev >= end || !end)
+                return prev;
         }
+        // I frames are too far apart, every following lookup goes through the directory
+    }
+
+    // the directory of a mapped index is only built when it is first needed
+    if (!sj_ic->key_frames && build_key_frames(sj_ic, 0) < 0)
+        return -2;
+
+    // first I frame at or after index_pos
+    high = sj_ic->key_frame_num;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (sj_ic->key_frames[mid] < index_pos)
+            low = mid + 1;
+        else
+            high = mid;
     }
+    next = low < sj_ic->key_frame_num ? sj_ic->key_frames[low] : sj_ic->index_num;
+
+    // if the next I_frame has a dts inferior to the searched dts then this I_frame is the related key_frame
+    if (next < sj_ic->index_num && entry_dts(sj_ic, next) < entry_dts(sj_ic, index_pos))
+        return next;
+    // otherwise, it is the I frame before the searched frame
+    if (next == index_pos)
+        return index_pos;
+    return low > 0 ? sj_ic->key_frames[low - 1] : -1;
+}
+
+static int find_I_frame(Index *key_frame, SJ_IndexContext *sj_ic, int index_pos)
+{
+    int pos = find_key_frame(sj_ic, index_pos);
+
+    if (pos == -2)
+        return -1;
+    if (pos >= 0)
+        get_entry(sj_ic, pos, key_frame);
     return 0;
 }
 
+/*
+ * computes the position of key from the segment that covers it,
+ * returns -1 if no segment does and -2 if the segments could not be built
+ */
+static int segment_search(SJ_IndexContext *sj_ic, uint64_t key, int mode)
+{
+    const SJ_IndexSegment *segments;
+    int low = 0, high;
+    int64_t value, offset;
+
+    // the segments of a mapped index are only built when they are first needed
+    if (!sj_ic->pts_segments && build_segments(sj_ic) < 0)
+        return -2;
+
+    if (mode == SJ_INDEX_TIMECODE_SEARCH) {
+        segments = sj_ic->tc_segments;
+        high = sj_ic->tc_segment_num;
+        value = timecode_frames(key, sj_ic->tc_rate);
+    } else {
+        segments = sj_ic->pts_segments;
+        high = sj_ic->pts_segment_num;
+        value = key;
+    }
+    // last segment starting at or before value
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (segments[mid].start <= value)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (!low)
+        return -1;
+    segments += low - 1;
+    offset = value - segments->start;
+    if (offset % segments->step || offset / segments->step >= segments->num)
+        return -1;
+    return segments->pos + offset / segments->step;
+}
+
+// key of the first index of a block, from the directory of a version 3 index or the sample of the pages
+static uint64_t block_first_key(const SJ_IndexContext *sj_ic, int block, int mode)
+{
+    const struct SJ_IndexPages *pages = sj_ic->pages;
+
+    if (sj_ic->block_dir) {
+        const uint8_t *dir = block_dir_entry(sj_ic, block);
+        return mode == SJ_INDEX_TIMECODE_SEARCH ? sj_rl32(dir + 32) : sj_rl64(dir + 8);
+    }
+    // the first keys of a page are sampled when it is read
+    if (!pages->sampled[block])
+        return get_search_value(sj_ic, block << sj_ic->block_bits, mode);
+    return mode == SJ_INDEX_TIMECODE_SEARCH ? pages->first_tc[block] : pages->first_pts[block];
+}
+
+/*
+ * narrows [low, high] to the block holding the first position whose key is greater than (upper)
+ * or not lower than (!upper) key, from the first keys of the blocks. That position can be high,
+ * the first one of the next block.
+ */
+static void block_bounds(const SJ_IndexContext *sj_ic, uint64_t key, int mode, int upper, int *low, int *high)
+{
+    int first = 0, last = block_num(sj_ic);
+
+    // blocks starting before the position
+    while (first < last) {
+        int mid = first + (last - first) / 2;
+        uint64_t read_time = block_first_key(sj_ic, mid, mode);
+        if (read_time < key || (upper && read_time == key))
+            first = mid + 1;
+        else
+            last = mid;
+    }
+    if (!first) {
+        *low = *high = 0;
+        return;
+    }
+    *low = (first - 1) << sj_ic->block_bits;
+    *high = FFMIN(first << sj_ic->block_bits, sj_ic->index_num);
+}
+
 static int search_frame(SJ_IndexContext *sj_ic, Index *read_idx, uint64_t search_time, int mode)
 {
-    int high = sj_ic->index_num;
+    int high = sj_ic->index_num - 1;
     int low = 0;
     int mid;
 
     uint64_t read_time = 0; // used to store the timecode members in a single 64 bits integer to facilitate comparison
 
+    search_time = get_search_key(search_time, mode);
+    // the segments would go through every block, the first keys of the blocks lead to the right one
+    mid = blockwise(sj_ic) ? -1 : segment_search(sj_ic, search_time, mode);
+    // a prediction is checked, the segment lookup only gives a candidate
+    if (mid >= 0 && get_search_value(sj_ic, mid, mode) == search_time) {
+        get_entry(sj_ic, mid, read_idx);
+        return mid;
+    }
+    if (sj_ic->tree_pos) {
+        mid = tree_bound(sj_ic, search_time, mode, 0);
+        if (mid < sj_ic->index_num && get_search_value(sj_ic, mid, mode) == search_time) {
+            get_entry(sj_ic, mid, read_idx);
+            return mid;
+        }
+        return -1;
+    }
+    if (blockwise(sj_ic)) {
+        block_bounds(sj_ic, search_time, mode, 0, &low, &high);
+        high = FFMIN(high, sj_ic->index_num - 1);
+    }
     while (low <= high) {
         mid = (high + low) / 2;
-        read_time = get_search_value(sj_ic->indexes[mid], mode);
+        read_time = get_search_value(sj_ic, mid, mode);
 
         if (read_time == search_time) {
-            *read_idx = sj_ic->indexes[mid];
+            get_entry(sj_ic, mid, read_idx);
             return mid;
         } else if (read_time > search_time) {
             high = mid - 1;
@@ -128,53 +1427,26 @@ static int search_frame(SJ_IndexContext *sj_ic, Index *read_idx, uint64_t search
     return -1;
 }
 
-// if there are no P or I frame before pos, function returns -1
-static av_always_inline int find_previous_key_frame(SJ_IndexContext sj_ic, int pos)
-{
-    int i;
-    for (i = pos; sj_ic.indexes[i].pic_type == FF_B_TYPE && i > 0; i--);
-    return i ? i : -1;
-}
-
 static int search_frame_dts(SJ_IndexContext *sj_ic, Index *read_idx, uint64_t search_time)
 {
-    int high = sj_ic->index_num;
-    int low = 0;
-    int mid;
-    int pos = -2; // pos initialized with a value that won't be returned by find_previous_key_frame
+    int64_t dts = search_time;
+    int low = 0, high = sj_ic->index_num;
 
-    while (1) {
-        mid = (high + low) / 2;
-        int kf_pos = find_previous_key_frame(*sj_ic, mid);
-        // if the same position is returned twice, then no matching index can be found
-        if (pos == kf_pos) {
-            return -1;
-        }
-        pos = kf_pos;
-        int i;
-        for (i = pos; i < sj_ic->index_num ; i++) {
-            if (sj_ic->indexes[i].dts == search_time) {
-                loop:
-                *read_idx = sj_ic->indexes[i];
-                return i;
-            }
-            if (sj_ic->indexes[i + 1].pic_type != FF_B_TYPE) {
-                break;
-            }
-        }
-        // the dts wasn't found in the set of B frames -> testing if it is in the key_frame that follows
-        if (sj_ic->indexes[i + 1].dts == search_time) {
-            i++;
-            goto loop;
-        }
+    // the dts order of a mapped index is only built when it is first needed
+    if (!sj_ic->dts_order && build_dts_order(sj_ic) < 0)
+        return -1;
 
-        if (search_time > sj_ic->indexes[i].dts) {
-            low = pos + 1;
-        } else {
-            high = pos - 1;
-        }
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (sj_ic->dts_keys[mid] < dts)
+            low = mid + 1;
+        else
+            high = mid;
     }
-    return -1;
+    if (low == sj_ic->index_num || sj_ic->dts_keys[low] != dts)
+        return -1;
+    get_entry(sj_ic, sj_ic->dts_order[low], read_idx);
+    return sj_ic->dts_order[low];
 }
 
 char sj_index_get_frame_type(Index idx)
@@ -198,8 +1470,383 @@ int sj_index_search(SJ_IndexContext *sj_ic, uint64_t search_time, Index *idx, In
         pos = search_frame_dts(sj_ic, idx, search_time);
     }
     if (idx->pic_type != FF_I_TYPE && pos >= 0) {
-        find_I_frame(key_frame, *sj_ic, pos);
+        find_I_frame(key_frame, sj_ic, pos);
     }
     return pos; // pos = -1 if frame wasn't found
 }
 
+typedef struct {
+    uint64_t key;
+    int query;
+} BatchQuery;
+
+static int batch_query_cmp(const void *q1, const void *q2)
+{
+    const BatchQuery *a = q1, *b = q2;
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+/*
+ * first position >= pos whose key is not lower than key, galloping from pos
+ * so that a sweep over sorted keys costs O(q log(n / q)) instead of O(n)
+ */
+static int gallop_to_key(const SJ_IndexContext *sj_ic, int pos, uint64_t key, int mode)
+{
+    int step = 1, low = pos, high;
+
+    if (pos >= sj_ic->index_num || get_search_value(sj_ic, pos, mode) >= key)
+        return pos;
+    while (low + step < sj_ic->index_num && get_search_value(sj_ic, low + step, mode) < key) {
+        low += step;
+        step *= 2;
+    }
+    // key(low) < key <= key(high)
+    high = FFMIN(low + step, sj_ic->index_num);
+    while (high - low > 1) {
+        int mid = low + (high - low) / 2;
+        if (get_search_value(sj_ic, mid, mode) < key)
+            low = mid;
+        else
+            high = mid;
+    }
+    return high;
+}
+
+int sj_index_search_batch(SJ_IndexContext *sj_ic, const uint64_t *search_times, int count,
+                          int *frame_pos, int *key_frame_pos, uint64_t mode)
+{
+    BatchQuery *queries;
+    int found = 0;
+    int pos = 0;
+    int i;
+
+    if (mode != SJ_INDEX_TIMECODE_SEARCH && mode != SJ_INDEX_PTS_SEARCH && mode != SJ_INDEX_DTS_SEARCH) {
+        return -4;  // invalid flag value
+    }
+    if (count <= 0)
+        return 0;
+
+    if (mode == SJ_INDEX_DTS_SEARCH) {
+        // indexes are not in dts order, resolve the queries one by one in the dts order
+        for (i = 0; i < count; i++) {
+            Index idx;
+            frame_pos[i] = search_frame_dts(sj_ic, &idx, search_times[i]);
+        }
+    } else {
+        queries = av_malloc(count * sizeof(*queries));
+        if (!queries)
+            return -1;
+        for (i = 0; i < count; i++) {
+            queries[i].key = get_search_key(search_times[i], mode);
+            queries[i].query = i;
+        }
+        qsort(queries, count, sizeof(*queries), batch_query_cmp);
+
+        for (i = 0; i < count; i++) {
+            pos = gallop_to_key(sj_ic, pos, queries[i].key, mode);
+            if (pos < sj_ic->index_num && get_search_value(sj_ic, pos, mode) == queries[i].key)
+                frame_pos[queries[i].query] = pos;
+            else
+                frame_pos[queries[i].query] = -1;
+        }
+        av_free(queries);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (frame_pos[i] < 0) {
+            if (key_frame_pos)
+                key_frame_pos[i] = -1;
+            continue;
+        }
+        found++;
+        if (key_frame_pos) {
+            key_frame_pos[i] = find_key_frame(sj_ic, frame_pos[i]);
+            if (key_frame_pos[i] == -2)
+                return -1;
+        }
+    }
+    return found;
+}
+
+/*
+ * first position whose key is greater than (upper) or not lower than (!upper) key,
+ * index_num if there is none
+ */
+static int search_bound(const SJ_IndexContext *sj_ic, uint64_t key, int mode, int upper)
+{
+    int low = 0, high = sj_ic->index_num;
+
+    if (sj_ic->tree_pos)
+        return tree_bound(sj_ic, key, mode, upper);
+    if (blockwise(sj_ic))
+        block_bounds(sj_ic, key, mode, upper, &low, &high);
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        uint64_t read_time = get_search_value(sj_ic, mid, mode);
+        if (read_time < key || (upper && read_time == key))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+#define TC_RATE_SCAN 64 // indexes read on each side of a nearest timecode for its frame rate, more than a second
+
+// distance between two search keys, timecodes are counted in frames at the rate of the index
+static av_always_inline uint64_t key_distance(uint64_t key1, uint64_t key2, int mode, int rate)
+{
+    if (mode == SJ_INDEX_TIMECODE_SEARCH) {
+        key1 = timecode_frames(key1, rate);
+        key2 = timecode_frames(key2, rate);
+    } else {
+        // pts are signed
+        return (int64_t)key1 > (int64_t)key2 ? key1 - key2 : key2 - key1;
+    }
+    return key1 > key2 ? key1 - key2 : key2 - key1;
+}
+
+int sj_index_lower_bound(SJ_IndexContext *sj_ic, uint64_t search_time, uint64_t mode)
+{
+    if (mode != SJ_INDEX_TIMECODE_SEARCH && mode != SJ_INDEX_PTS_SEARCH) {
+        return -4;
+    }
+    return search_bound(sj_ic, get_search_key(search_time, mode), mode, 0);
+}
+
+int sj_index_upper_bound(SJ_IndexContext *sj_ic, uint64_t search_time, uint64_t mode)
+{
+    if (mode != SJ_INDEX_TIMECODE_SEARCH && mode != SJ_INDEX_PTS_SEARCH) {
+        return -4;
+    }
+    return search_bound(sj_ic, get_search_key(search_time, mode), mode, 1);
+}
+
+int sj_index_nearest(SJ_IndexContext *sj_ic, uint64_t search_time, uint64_t mode)
+{
+    uint64_t key;
+    int pos;
+    int rate = 0;
+
+    if (mode != SJ_INDEX_TIMECODE_SEARCH && mode != SJ_INDEX_PTS_SEARCH) {
+        return -4;
+    }
+    key = get_search_key(search_time, mode);
+    pos = search_bound(sj_ic, key, mode, 0);
+    if (pos == sj_ic->index_num)
+        return pos - 1;
+    if (mode == SJ_INDEX_TIMECODE_SEARCH && pos > 0) {
+        // the frame rate of the timecodes is found with the segments, the search can go on without them
+        if (!sj_ic->pts_segments && !blockwise(sj_ic))
+            build_segments(sj_ic);
+        rate = sj_ic->tc_rate;
+        // a blockwise context only reads the pages around pos, where every frame number of a second shows
+        if (!sj_ic->pts_segments)
+            rate = timecode_rate(sj_ic, FFMAX(pos - TC_RATE_SCAN, 0), FFMIN(pos + TC_RATE_SCAN, sj_ic->index_num));
+    }
+    if (pos > 0 && key_distance(get_search_value(sj_ic, pos - 1, mode), key, mode, rate) <=
+                   key_distance(get_search_value(sj_ic, pos, mode), key, mode, rate))
+        return pos - 1;
+    return pos;
+}
+
+int sj_index_range(SJ_IndexContext *sj_ic, uint64_t from, uint64_t to, uint64_t mode, int *count)
+{
+    int first, last;
+
+    if (mode != SJ_INDEX_TIMECODE_SEARCH && mode != SJ_INDEX_PTS_SEARCH) {
+        return -4;
+    }
+    first = search_bound(sj_ic, get_search_key(from, mode), mode, 0);
+    last = search_bound(sj_ic, get_search_key(to, mode), mode, 1);
+    *count = FFMAX(last - first, 0);
+    return first;
+}
+
+int sj_index_get(SJ_IndexContext *sj_ic, int pos, Index *idx)
+{
+    if (pos < 0 || pos >= sj_ic->index_num)
+        return -1;
+    get_entry(sj_ic, pos, idx);
+    return 0;
+}
+
+const Index *sj_index_view(SJ_IndexContext *sj_ic, int pos)
+{
+    if (!sj_ic->indexes || pos < 0 || pos >= sj_ic->index_num)
+        return NULL;
+    return &sj_ic->indexes[pos];
+}
+
+size_t sj_index_memory(const SJ_IndexContext *sj_ic)
+{
+    size_t n = sj_ic->index_num;
+    size_t size = sizeof(*sj_ic);
+
+    if (sj_ic->indexes)
+        size += n * sizeof(Index);
+    if (sj_ic->map)
+        size += sj_ic->map_size;
+    if (sj_ic->tree_pos)
+        size += (n + 1) * (sizeof(*sj_ic->tree_tc) + sizeof(*sj_ic->tree_pts) + sizeof(*sj_ic->tree_pos));
+    if (sj_ic->dts_order)
+        size += n * (sizeof(*sj_ic->dts_keys) + sizeof(*sj_ic->dts_order));
+    if (sj_ic->block_indexes)
+        size += n * sizeof(Index) + block_num(sj_ic);
+    if (sj_ic->pages) {
+        const struct SJ_IndexPages *pages = sj_ic->pages;
+        size += sizeof(*pages) + pages->buf_size +
+                pages->slot_num * (sizeof(*pages->cache) + sizeof(*pages->cached)) +
+                block_num(sj_ic) * (sizeof(*pages->first_pts) + sizeof(*pages->first_tc) + 1);
+        // the pages read so far
+        for (int i = 0; i < pages->slot_num; i++) {
+            if (pages->cache[i])
+                size += sizeof(Index) << sj_ic->block_bits;
+        }
+        if (pages->dir)
+            size += block_num(sj_ic) * BLOCK_DIR_ENTRY_SIZE;
+    }
+    size += sj_ic->key_frame_num * sizeof(*sj_ic->key_frames);
+    size += (sj_ic->pts_segment_num + sj_ic->tc_segment_num) * sizeof(SJ_IndexSegment);
+    return size;
+}
+
+/**
+ * Context shared by the threads of the process, see sj_index_acquire
+ */
+typedef struct SharedIndex {
+    SJ_IndexContext sj_ic;
+    int flags; /// flags it was acquired with
+    dev_t dev; /// device, inode, size and modification time of the file when it was loaded
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    int refs; /// references returned by sj_index_acquire and not released yet
+    int current; /// the file has not changed since, the context is returned to the next acquirers
+    struct SharedIndex *next;
+} SharedIndex;
+
+// the list and the reference counts are only touched under the lock, searches never take it
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static SharedIndex *shared_indexes;
+
+/*
+ * builds everything a search would otherwise build on first use,
+ * the context is then only read by the searches
+ */
+static int index_freeze(SJ_IndexContext *sj_ic)
+{
+    int block;
+
+    if ((!sj_ic->key_frames && build_key_frames(sj_ic, 0) < 0) ||
+        (!sj_ic->pts_segments && build_segments(sj_ic) < 0) ||
+        (!sj_ic->dts_order && build_dts_order(sj_ic) < 0))
+        return -1;
+    if (sj_ic->block_indexes) {
+        for (block = 0; block < block_num(sj_ic); block++)
+            block_entry(sj_ic, block << sj_ic->block_bits);
+    }
+    return 0;
+}
+
+// current shared context of the file described by st, with a reference added, NULL if none
+static SJ_IndexContext *find_shared(const char *filename, int flags, const struct stat *st)
+{
+    SharedIndex *s;
+
+    for (s = shared_indexes; s; s = s->next) {
+        if (!s->current || s->flags != flags || strcmp(s->sj_ic.filename, filename))
+            continue;
+        if (s->dev == st->st_dev && s->ino == st->st_ino && s->size == st->st_size && s->mtime == st->st_mtime) {
+            s->refs++;
+            return &s->sj_ic;
+        }
+        // the file changed, the context stays valid for the references already returned
+        s->current = 0;
+    }
+    return NULL;
+}
+
+SJ_IndexContext *sj_index_acquire(const char *filename, int flags, int *err)
+{
+    SJ_IndexContext *sj_ic;
+    SharedIndex *s;
+    struct stat st;
+    int ret;
+
+    if (stat(filename, &st) < 0) {
+        *err = -1;
+        return NULL;
+    }
+    pthread_mutex_lock(&shared_lock);
+    sj_ic = find_shared(filename, flags, &st);
+    pthread_mutex_unlock(&shared_lock);
+    if (sj_ic)
+        return sj_ic;
+
+    // loaded without the lock, other files are acquired meanwhile
+    s = av_mallocz(sizeof(*s));
+    if (!s) {
+        *err = -1;
+        return NULL;
+    }
+    ret = sj_index_load2((char *)filename, &s->sj_ic, flags & ~SJ_INDEX_LOAD_LAZY);
+    if (!ret && index_freeze(&s->sj_ic) < 0) {
+        sj_index_unload(&s->sj_ic);
+        ret = -1;
+    }
+    if (ret < 0) {
+        av_free(s);
+        *err = ret;
+        return NULL;
+    }
+    s->flags = flags;
+    s->dev = st.st_dev;
+    s->ino = st.st_ino;
+    s->size = st.st_size;
+    s->mtime = st.st_mtime;
+    s->refs = 1;
+    s->current = 1;
+
+    pthread_mutex_lock(&shared_lock);
+    // another thread may have loaded the same file in the meantime
+    sj_ic = find_shared(filename, flags, &st);
+    if (!sj_ic) {
+        s->next = shared_indexes;
+        shared_indexes = s;
+    }
+    pthread_mutex_unlock(&shared_lock);
+    if (sj_ic) {
+        sj_index_unload(&s->sj_ic);
+        av_free(s);
+        return sj_ic;
+    }
+    return &s->sj_ic;
+}
+
+void sj_index_retain(SJ_IndexContext *sj_ic)
+{
+    SharedIndex *s = (SharedIndex *)((uint8_t *)sj_ic - offsetof(SharedIndex, sj_ic));
+
+    pthread_mutex_lock(&shared_lock);
+    s->refs++;
+    pthread_mutex_unlock(&shared_lock);
+}
+
+void sj_index_release(SJ_IndexContext *sj_ic)
+{
+    SharedIndex *s = (SharedIndex *)((uint8_t *)sj_ic - offsetof(SharedIndex, sj_ic));
+    SharedIndex **p;
+
+    pthread_mutex_lock(&shared_lock);
+    if (--s->refs) {
+        pthread_mutex_unlock(&shared_lock);
+        return;
+    }
+    for (p = &shared_indexes; *p != s; p = &(*p)->next)
+        ;
+    *p = s->next;
+    pthread_mutex_unlock(&shared_lock);
+    sj_index_unload(&s->sj_ic);
+    av_free(s);
+}
@@ -1,15 +1,33 @@
 #ifndef SJ_SEARCH_H
 #define SJ_SEARCH_H
 
-#define LIBSJINDEX_MAJOR 0
+#define LIBSJINDEX_MAJOR 1
 #define LIBSJINDEX_MINOR 0
-#define LIBSJINDEX_PATCH 1
+#define LIBSJINDEX_PATCH 0
 
 #define LIBSJINDEX_VERSION ((LIBSJINDEX_MAJOR << 16) | (LIBSJINDEX_MINOR << 8) | LIBSJINDEX_PATCH)
 #define SJ_INDEX_TIMECODE_SEARCH 1
 #define SJ_INDEX_PTS_SEARCH 2
 #define SJ_INDEX_DTS_SEARCH 4
 
+/* sj_index_load2 flags */
+#define SJ_INDEX_LOAD_MMAP 1 /// map the file read-only and search the records in place
+#define SJ_INDEX_LOAD_EYTZINGER 2 /// build a cache friendly search tree of the timecode and pts keys
+#define SJ_INDEX_LOAD_LAZY 4 /// only read the header, the indexes are read a page at a time as they are searched
+
+struct SJ_IndexPages;
+
+/**
+ * Run of consecutive indexes whose pts or timecode grows by a constant step,
+ * the position of a value in it is computed instead of searched
+ */
+typedef struct {
+    int pos; /// position of the first index of the segment
+    int num; /// number of indexes in the segment
+    int64_t start; /// value of the first index, pts or timecode as a frame count
+    int64_t step; /// value difference between two consecutive indexes
+} SJ_IndexSegment;
+
 /**
  * Index context, initialized with sj_index_load
  * Used in sj_index_search to find a frame
@@ -23,6 +41,33 @@ typedef struct {
     Timecode start_timecode; /// timecode of the first frame to be displayed
     Index *indexes; /// list of indexes read from the file
     char *filename; /// index file name
+    int flags; /// flags the index was loaded with, used again by sj_index_refresh
+    const uint8_t *map; /// mapped index file, NULL unless loaded with SJ_INDEX_LOAD_MMAP
+    size_t map_size; /// size of the mapping
+    const uint8_t *records; /// first record in the mapping, used when indexes is NULL
+    const uint8_t *pts_col; /// pts column of a mapped version 1 index, NULL otherwise
+    const uint8_t *dts_col; /// dts column of a mapped version 1 index
+    const uint8_t *pes_col; /// pes offset column of a mapped version 1 index
+    const uint8_t *tc_col; /// packed timecode column of a mapped version 1 index
+    const uint8_t *type_col; /// picture type column of a mapped version 1 index
+    int *key_frames; /// positions of the I frames in indexes, in index order
+    int key_frame_num; /// number of I frames
+    uint32_t *tree_tc; /// packed timecodes in search tree order, NULL unless loaded with SJ_INDEX_LOAD_EYTZINGER
+    uint64_t *tree_pts; /// pts in search tree order
+    int *tree_pos; /// position in indexes of each node of the search tree
+    SJ_IndexSegment *pts_segments; /// constant frame rate runs of pts, in index order
+    int pts_segment_num; /// number of pts segments
+    SJ_IndexSegment *tc_segments; /// constant frame rate runs of timecodes, in index order
+    int tc_segment_num; /// number of timecode segments
+    int tc_rate; /// frames per second of the timecodes, used to count them in frames
+    int64_t *dts_keys; /// dts of the indexes, sorted
+    int *dts_order; /// position in indexes of each entry of dts_keys
+    int block_bits; /// log2 of the number of indexes per block of a version 3 index
+    uint64_t block_dir_offset; /// file offset of the block directory of a version 3 index
+    const uint8_t *block_dir; /// block directory in the mapping of a version 3 index, NULL otherwise
+    Index *block_indexes; /// indexes of a mapped version 3 index, a block is decoded on its first access
+    uint8_t *block_decoded; /// set for each block of block_indexes already decoded
+    struct SJ_IndexPages *pages; /// pages read and sample of the keys of an index loaded with SJ_INDEX_LOAD_LAZY, NULL otherwise
 } SJ_IndexContext;
 
 /**
@@ -31,6 +76,26 @@ typedef struct {
  */
 int sj_index_load(char *filename, SJ_IndexContext *sj_ic);
 
+/**
+ * Same as sj_index_load, flags selects how the file is loaded (see README.rst) : SJ_INDEX_LOAD_MMAP searches
+ * the mapped file in place, SJ_INDEX_LOAD_EYTZINGER adds a cache friendly search tree of the keys and
+ * SJ_INDEX_LOAD_LAZY reads the indexes a page at a time as they are searched. Versions 0 to 3 are read.
+ * Returns 0 on success, -1 if the file could not be open, -2 if it is not an index file,
+ * -3 if it could not be mapped, -4 if the index is empty and -5 if the version is unknown.
+ */
+int sj_index_load2(char *filename, SJ_IndexContext *sj_ic, int flags);
+
+/**
+ * Brings a loaded context up to date with its file while the indexer appends to it (indexer -f).
+ * The records appended to a version 0 or 2 file since the last load or refresh are read, or mapped again,
+ * and the key frame directory, segment tables and dts order are extended without going over the
+ * previous indexes again, the search tree is rebuilt from the keys. A file rewritten in any other way
+ * is loaded again. Returns the number of indexes added, or a sj_index_load2 error code. If the appended
+ * records could not be read the context keeps its previous indexes, if the file could not be loaded again
+ * it is unloaded. The context must not be searched during the refresh.
+ */
+int sj_index_refresh(SJ_IndexContext *sj_ic);
+
 /**
  * Resets the SJ_IndexContext (empties the list, set all other variables to 0.
  */
@@ -51,8 +116,82 @@ char sj_index_get_frame_type(Index idx);
  *      if mode = SJ_INDEX_TIMECODE_SEARCH then the function will look for a index with a timecode equal to search_time
  *      if mode = SJ_INDEX_PTS_SEARCH then the function will look for a index with a pts equal to search_time
  *      if mode = SJ_INDEX_DTS_SEARCH then the function will look for a index with a dts equal to search_time
+ *
+ * Timecode and pts values that fall in a constant frame rate segment are found in constant time,
+ * the others with a binary search. Dts values are searched in a dts ordered copy of the keys.
  */
 int sj_index_search(SJ_IndexContext *sj_ic, uint64_t search_time, Index *idx, Index *key_frame, uint64_t mode);
 
+/**
+ * Searches count values at once, search_times[i] is looked for as in sj_index_search.
+ * frame_pos[i] is set to the position of the matching index in the index list or to -1 if it is not found,
+ * key_frame_pos[i], if key_frame_pos is not NULL, to the position of its related key frame (the frame itself
+ * for an I frame) or to -1.
+ *
+ * Timecode and pts queries are sorted and resolved in a single sweep over the indexes,
+ * dts queries are resolved one by one with a binary search.
+ * Returns the number of values found, -1 if memory could not be allocated or -4 if mode is invalid.
+ */
+int sj_index_search_batch(SJ_IndexContext *sj_ic, const uint64_t *search_times, int count,
+                          int *frame_pos, int *key_frame_pos, uint64_t mode);
+
+/**
+ * Position queries on timecode (SJ_INDEX_TIMECODE_SEARCH) or pts (SJ_INDEX_PTS_SEARCH), in logarithmic time.
+ * They return a position in the index list, or -4 if mode is invalid.
+ *
+ * sj_index_lower_bound returns the first index whose value is not lower than search_time,
+ * sj_index_upper_bound the first one whose value is greater than search_time,
+ * both return index_num if there is no such index.
+ * sj_index_nearest returns the index whose value is the closest to search_time, the earliest one on a tie.
+ * sj_index_range returns the first index whose value is in [from, to] and sets count to the number of
+ * consecutive indexes in that interval.
+ */
+int sj_index_lower_bound(SJ_IndexContext *sj_ic, uint64_t search_time, uint64_t mode);
+int sj_index_upper_bound(SJ_IndexContext *sj_ic, uint64_t search_time, uint64_t mode);
+int sj_index_nearest(SJ_IndexContext *sj_ic, uint64_t search_time, uint64_t mode);
+int sj_index_range(SJ_IndexContext *sj_ic, uint64_t from, uint64_t to, uint64_t mode, int *count);
+
+/**
+ * Copies the index at position pos in idx, returns -1 if pos is out of the index list.
+ */
+int sj_index_get(SJ_IndexContext *sj_ic, int pos, Index *idx);
+
+/**
+ * Returns a pointer to the index at position pos, the count indexes returned by sj_index_range
+ * can be read from it without copy. Returns NULL if pos is out of the list or if the context
+ * was loaded with SJ_INDEX_LOAD_MMAP, use sj_index_get then.
+ */
+const Index *sj_index_view(SJ_IndexContext *sj_ic, int pos);
+
+/**
+ * Returns the bytes of memory held by a loaded context, mapped pages included, for the caller to bound
+ * the number of contexts it keeps loaded. The structures built and the pages read on first use are counted
+ * from then on.
+ */
+size_t sj_index_memory(const SJ_IndexContext *sj_ic);
+
+/**
+ * Returns a context of filename shared by the whole process, loading the file only if no current
+ * context of it was acquired with the same flags, or NULL and a sj_index_load2 error code in err.
+ * A file changed since its context was loaded is loaded again, the old context stays valid for its
+ * holders until they release it.
+ * Everything the searches build on first use is built before the context is returned, so that any
+ * number of threads can search it at the same time without locking. SJ_INDEX_LOAD_LAZY is ignored.
+ * The context is read-only : it must not be refreshed or unloaded, only released.
+ * sj_index_load2 can be called from several threads, on distinct contexts.
+ */
+SJ_IndexContext *sj_index_acquire(const char *filename, int flags, int *err);
+
+/**
+ * Adds a reference to a context returned by sj_index_acquire.
+ */
+void sj_index_retain(SJ_IndexContext *sj_ic);
+
+/**
+ * Drops a reference to a context returned by sj_index_acquire, the context is unloaded
+ * with its last reference.
+ */
+void sj_index_release(SJ_IndexContext *sj_ic);
+
 #endif /* SJ_SEARCH_H */
 
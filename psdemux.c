@@ -0,0 +1,121 @@
+/*
+ * psdemux.c walks the pack and PES headers of a MPEG program stream
+ * directly over the input bytes and returns the PES payloads without copying them
+ *
+ */
+#include <ffmpeg/avformat.h>
+#include <errno.h>
+
+#include "psdemux.h"
+
+#define PACK_START_CODE           0x000001ba
+#define SYSTEM_HEADER_START_CODE  0x000001bb
+#define PROGRAM_END_CODE          0x000001b9
+
+static av_always_inline int64_t get_pes_pts(const uint8_t *p)
+{
+    return (int64_t)((p[0] >> 1) & 0x07) << 30 | ((p[1] << 8 | p[2]) >> 1) << 15 | (p[3] << 8 | p[4]) >> 1;
+}
+
+// audio, video and private stream 1 carry elementary streams with a PES header
+static av_always_inline int is_es_stream(int id)
+{
+    return id == 0xbd || (id >= 0xc0 && id <= 0xef);
+}
+
+void ps_demux_init(PSDemux *ps, const uint8_t *buf, int64_t size, offset_t offset)
+{
+    ps->buf = ps->ptr = buf;
+    ps->end = buf + size;
+    ps->offset = offset;
+}
+
+/*
+ * parses the PES header after the length field, sets the timestamps and the payload start,
+ * returns -1 if the header is invalid
+ */
+static int parse_pes_header(PSPacket *pkt, const uint8_t *p, const uint8_t *end)
+{
+    pkt->pts = pkt->dts = AV_NOPTS_VALUE;
+    if (p < end && (*p & 0xc0) == 0x80) {
+        // MPEG-2
+        if (end - p < 3 || end - p < 3 + p[2])
+            return -1;
+        int flags = p[1];
+        if ((flags & 0x80) && p[2] >= 5)
+            pkt->pts = pkt->dts = get_pes_pts(p + 3);
+        if ((flags & 0xc0) == 0xc0 && p[2] >= 10)
+            pkt->dts = get_pes_pts(p + 8);
+        p += 3 + p[2];
+    } else {
+        // MPEG-1 : stuffing, buffer size, then timestamps
+        while (p < end && *p == 0xff)
+            p++;
+        if (p < end && (*p & 0xc0) == 0x40)
+            p += 2;
+        if (end - p >= 5 && (*p & 0xf0) == 0x20) {
+            pkt->pts = pkt->dts = get_pes_pts(p);
+            p += 5;
+        } else if (end - p >= 10 && (*p & 0xf0) == 0x30) {
+            pkt->pts = get_pes_pts(p);
+            pkt->dts = get_pes_pts(p + 5);
+            p += 10;
+        } else if (p < end && *p == 0x0f) {
+            p++;
+        } else {
+            return -1;
+        }
+        if (p > end)
+            return -1;
+    }
+    pkt->data = p;
+    pkt->size = end - p;
+    return 0;
+}
+
+int ps_read_packet(PSDemux *ps, PSPacket *pkt)
+{
+    const uint8_t *p = ps->ptr;
+
+    while (1) {
+        int len;
+        // resynchronize on the next start code
+        while (p + 3 < ps->end && (p[0] || p[1] || p[2] != 1 || p[3] < 0xb9))
+            p++;
+        ps->ptr = p;
+        if (ps->end - p < 6)
+            return AVERROR(EAGAIN);
+
+        uint32_t code = 0x100 | p[3];
+        if (code == PROGRAM_END_CODE) {
+            p += 4;
+            continue;
+        }
+        if (code == PACK_START_CODE) {
+            if ((p[4] & 0xc0) == 0x40) {
+                // MPEG-2 pack header, followed by stuffing
+                if (ps->end - p < 14)
+                    return AVERROR(EAGAIN);
+                len = 14 + (p[13] & 0x07);
+            } else {
+                len = 12;
+            }
+            if (ps->end - p < len)
+                return AVERROR(EAGAIN);
+            p += len;
+            continue;
+        }
+
+        len = 6 + (p[4] << 8 | p[5]);
+        if (ps->end - p < len)
+            return AVERROR(EAGAIN);
+        if (code != SYSTEM_HEADER_START_CODE && is_es_stream(p[3]) &&
+            !parse_pes_header(pkt, p + 6, p + len)) {
+            pkt->stream_id = code;
+            pkt->pes_offset = ps->offset + (p - ps->buf);
+            ps->ptr = p + len;
+            return 0;
+        }
+        p += len;
+    }
+}
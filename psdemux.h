@@ -0,0 +1,40 @@
+#ifndef PSDEMUX_H
+#define PSDEMUX_H
+
+/**
+ * Program stream demuxer working in place over a window of the input
+ * (a mapping of the whole file or a read buffer), packets point into the window
+ */
+typedef struct {
+    const uint8_t *buf;     ///< first byte of the window
+    const uint8_t *end;     ///< end of the window
+    const uint8_t *ptr;     ///< parse position in the window
+    offset_t offset;        ///< input offset of buf
+} PSDemux;
+
+/**
+ * PES packet payload, data points into the demuxer window
+ */
+typedef struct {
+    const uint8_t *data;
+    int size;
+    int stream_id;          ///< PES start code, 0x1e0 for the first video stream
+    offset_t pes_offset;    ///< input offset of the PES start code
+    int64_t pts;            ///< AV_NOPTS_VALUE if the packet has no timestamp
+    int64_t dts;            ///< equal to pts if only the pts is coded
+} PSPacket;
+
+/**
+ * Sets the window the demuxer parses, offset is the input offset of buf
+ */
+void ps_demux_init(PSDemux *ps, const uint8_t *buf, int64_t size, offset_t offset);
+
+/**
+ * Reads the next elementary stream PES packet, skipping pack and system headers,
+ * padding and other streams and resynchronizing on invalid data.
+ * Returns 0 on success or AVERROR(EAGAIN) if the window ends before the next packet,
+ * ps->ptr is then left on the first byte not consumed.
+ */
+int ps_read_packet(PSDemux *ps, PSPacket *pkt);
+
+#endif
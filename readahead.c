@@ -0,0 +1,178 @@
+/*
+ * readahead.c reads the input on its own thread into a ring of large aligned buffers,
+ * so that reading and parsing overlap
+ *
+ */
+#define _XOPEN_SOURCE 600
+#include <ffmpeg/avformat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "readahead.h"
+
+// waits ms or until the reader is stopped, the lock is held
+static void wait_input(ReadAhead *ra, int ms)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += ms % 1000 * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    while (!ra->stop && pthread_cond_timedwait(&ra->cond, &ra->lock, &ts) != ETIMEDOUT)
+        ;
+}
+
+static void *read_ahead_thread(void *arg)
+{
+    ReadAhead *ra = arg;
+    int tail = 0;
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->stop && !ra->eof && !ra->error) {
+        // the buffer held by the parser is not overwritten
+        if (ra->ready + (ra->held >= 0) == ra->depth) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+        ReadAheadBuffer *buf = &ra->bufs[tail];
+        uint8_t *data = buf->mem + READ_AHEAD_HEADROOM;
+        int size = 0, ret = 0;
+        pthread_mutex_unlock(&ra->lock);
+
+        while (size < ra->buf_size) {
+            ret = read(ra->fd, data + size, ra->buf_size - size);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                break;
+            size += ret;
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        if (ret < 0)
+            ra->error = AVERROR(errno);
+        // only the last read of the input is short, unless it is still growing
+        if (size < ra->buf_size && !ra->follow)
+            ra->eof = 1;
+        buf->size = size;
+        buf->skip = FFMIN(ra->skip, size);
+        buf->offset = ra->offset;
+        ra->offset += size;
+        ra->skip -= buf->skip;
+        if (size > buf->skip) {
+            ra->ready++;
+            tail = (tail + 1) % ra->depth;
+            ra->idle = ra->idle_seen = 0;
+        } else if (ra->follow && !ra->error) {
+            ra->idle++;
+            pthread_cond_broadcast(&ra->cond);
+            wait_input(ra, ra->follow);
+        }
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+int read_ahead_open(ReadAhead *ra, int fd, offset_t start, int depth, int buf_size, int follow)
+{
+    int i;
+
+    memset(ra, 0, sizeof(*ra));
+    if (depth < 2 || buf_size <= 0)
+        return AVERROR(EINVAL);
+    ra->fd = fd;
+    ra->depth = depth;
+    ra->buf_size = buf_size;
+    ra->held = -1;
+    ra->follow = follow;
+    ra->offset = start & ~(offset_t)(READ_AHEAD_ALIGN - 1);
+    ra->skip = start - ra->offset;
+    if (ra->offset && lseek(fd, ra->offset, SEEK_SET) < 0)
+        return AVERROR(errno);
+
+    ra->bufs = av_mallocz(depth * sizeof(*ra->bufs));
+    if (!ra->bufs)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < depth; i++) {
+        void *mem;
+        if (posix_memalign(&mem, READ_AHEAD_ALIGN, READ_AHEAD_HEADROOM + buf_size)) {
+            read_ahead_close(ra);
+            return AVERROR(ENOMEM);
+        }
+        ra->bufs[i].mem = mem;
+    }
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    if (pthread_create(&ra->thread, NULL, read_ahead_thread, ra)) {
+        pthread_mutex_destroy(&ra->lock);
+        pthread_cond_destroy(&ra->cond);
+        read_ahead_close(ra);
+        return AVERROR(EAGAIN);
+    }
+    ra->started = 1;
+    return 0;
+}
+
+const uint8_t *read_ahead_next(ReadAhead *ra, const uint8_t *keep, int keep_size, int *size, offset_t *offset)
+{
+    ReadAheadBuffer *buf;
+    uint8_t *data;
+
+    if (keep_size > READ_AHEAD_HEADROOM) {
+        ra->error = AVERROR(EINVAL);
+        return NULL;
+    }
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->ready && !ra->eof && !ra->error && ra->idle == ra->idle_seen)
+        pthread_cond_wait(&ra->cond, &ra->lock);
+    if (!ra->ready) {
+        ra->idle_seen = ra->idle;
+        pthread_mutex_unlock(&ra->lock);
+        return NULL;
+    }
+    buf = &ra->bufs[ra->head];
+    pthread_mutex_unlock(&ra->lock);
+
+    // the previous buffer is still held, keep points into it
+    data = buf->mem + READ_AHEAD_HEADROOM + buf->skip - keep_size;
+    if (keep_size)
+        memcpy(data, keep, keep_size);
+    *size = buf->size - buf->skip + keep_size;
+    *offset = buf->offset + buf->skip - keep_size;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->held = ra->head;
+    ra->head = (ra->head + 1) % ra->depth;
+    ra->ready--;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    return data;
+}
+
+void read_ahead_close(ReadAhead *ra)
+{
+    int i;
+
+    if (ra->started) {
+        pthread_mutex_lock(&ra->lock);
+        ra->stop = 1;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+        pthread_join(ra->thread, NULL);
+        pthread_mutex_destroy(&ra->lock);
+        pthread_cond_destroy(&ra->cond);
+    }
+    for (i = 0; ra->bufs && i < ra->depth; i++)
+        free(ra->bufs[i].mem);
+    av_free(ra->bufs);
+    ra->bufs = NULL;
+    ra->started = 0;
+}
@@ -0,0 +1,65 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <pthread.h>
+
+#define READ_AHEAD_ALIGN 4096
+/// room kept before the data of each buffer, the bytes left unparsed in the previous buffer are copied there
+#define READ_AHEAD_HEADROOM (1 << 17)
+
+typedef struct {
+    uint8_t *mem;           ///< headroom followed by the data
+    int size;               ///< bytes read in the data
+    int skip;               ///< bytes of data before the requested start
+    offset_t offset;        ///< input offset of the data
+} ReadAheadBuffer;
+
+/**
+ * Ring of buffers filled in order by an I/O thread while the caller parses the previous ones
+ */
+typedef struct {
+    int fd;
+    int depth;              ///< number of buffers in the ring
+    int buf_size;           ///< data size of each buffer
+    ReadAheadBuffer *bufs;
+    int head;               ///< next buffer handed to the caller
+    int ready;              ///< buffers filled and not yet handed to the caller
+    int held;               ///< buffer the caller is parsing, -1 if none
+    int eof;
+    int stop;
+    int error;
+    int skip;               ///< bytes to skip at the start of the first buffer
+    offset_t offset;        ///< input offset of the next read
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int started;            ///< the I/O thread is running
+    int follow;             ///< ms between two reads at the end of a growing input, 0 to stop at the end
+    int idle;               ///< reads that found no new data since the last data
+    int idle_seen;          ///< idle count last reported by read_ahead_next
+} ReadAhead;
+
+/**
+ * Starts reading fd from offset start (0 for a pipe) into depth buffers of buf_size bytes, depth is at least 2.
+ * Reads start on a READ_AHEAD_ALIGN boundary and the buffers are aligned, fd can be opened with O_DIRECT
+ * if buf_size is a multiple of READ_AHEAD_ALIGN. If follow is not 0 the input is a file still being written :
+ * the end of the input is read again every follow ms until read_ahead_close. Returns 0 or a negative error code.
+ */
+int read_ahead_open(ReadAhead *ra, int fd, offset_t start, int depth, int buf_size, int follow);
+
+/**
+ * Returns the data of the next buffer, waiting for it to be read if needed, and releases the previous one.
+ * The keep_size bytes at keep, the end of the previous buffer not parsed yet, are copied just before
+ * the new data so that the returned data continues them. size and offset are set to the size and input
+ * offset of the returned data. Returns NULL at the end of the input or on error, see ra->error.
+ * When following a growing input, NULL is also returned each time a read finds no new data,
+ * ra->idle then counts those reads since the last data.
+ */
+const uint8_t *read_ahead_next(ReadAhead *ra, const uint8_t *keep, int keep_size, int *size, offset_t *offset);
+
+/**
+ * Stops the I/O thread and frees the buffers, the file descriptor is left open.
+ */
+void read_ahead_close(ReadAhead *ra);
+
+#endif
@@ -1,9 +1,200 @@
+#define _XOPEN_SOURCE 600
 #include <ffmpeg/avformat.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "libsjindex/indexer.h"
 #include "libsjindex/sj_search_index.h"
+#include "libsjindex/sj_index_catalog.h"
+#include "searchd.h"
+
+static void print_load_error(int load_res)
+{
+    if (load_res == -1) {
+        printf("File could not be open\n");
+    }
+
+    if (load_res == -2) {
+        printf("File is not a index file\n");
+    }
+
+    if (load_res == -3) {
+        printf("File could not be mapped\n");
+    }
+
+    if (load_res == -4) {
+        printf("Index is empty\n");
+    }
+
+    if (load_res == -5) {
+        printf("Unsupported index version\n");
+    }
+}
+
+static void print_frame(Index read_idx, Index key_frame)
+{
+    printf("Frame %c : \t\ntimecode\t%02d:%02d:%02d:%02d\nPTS\t\t%lld\nDTS\t\t%lld\nPES-OFFSET\t\t%lld\n", sj_index_get_frame_type(read_idx) ,read_idx.timecode.hours, read_idx.timecode.minutes, read_idx.timecode.seconds, read_idx.timecode.frames, read_idx.pts, read_idx.dts, read_idx.pes_offset);
+    printf("Related key-frame : \t\ntimecode\t%02d:%02d:%02d:%02d\nPTS\t\t%lld\nDTS\t\t%lld\nPES-OFFSET\t\t%lld\n", key_frame.timecode.hours,key_frame.timecode.minutes, key_frame.timecode.seconds, key_frame.timecode.frames, key_frame.pts, key_frame.dts, key_frame.pes_offset);
+}
+
+// reads an index as written by searchd, returns the characters read or -1
+static int parse_index(const char *p, Index *idx)
+{
+    int pic_type, hours, minutes, seconds, frames;
+    long long pts, dts, pes_offset;
+    int len;
+
+    if (sscanf(p, "%d %d:%d:%d:%d %lld %lld %lld%n", &pic_type, &hours, &minutes, &seconds, &frames,
+               &pts, &dts, &pes_offset, &len) != 8)
+        return -1;
+    idx->pic_type = pic_type;
+    idx->timecode.hours = hours;
+    idx->timecode.minutes = minutes;
+    idx->timecode.seconds = seconds;
+    idx->timecode.frames = frames;
+    idx->pts = pts;
+    idx->dts = dts;
+    idx->pes_offset = pes_offset;
+    return len;
+}
+
+/*
+ * sends the search of the count values to the searchd daemon listening on socket_path,
+ * which answers from the index it keeps loaded
+ */
+static int search_remote(const char *socket_path, const char *mode, const char *filename, char **values, int count)
+{
+    struct sockaddr_un addr;
+    char path[PATH_MAX];
+    char *line;
+    FILE *f;
+    int len;
+    int fd;
+    int res = 0;
+    int i;
+
+    // the daemon does not run in the current directory
+    if (!realpath(filename, path)) {
+        print_load_error(-1);
+        return 0;
+    }
+    line = av_malloc(SEARCHD_MAX_LINE);
+    if (!line) {
+        printf("could not allocate memory\n");
+        return 1;
+    }
+    len = snprintf(line, SEARCHD_MAX_LINE, "%s %s", mode, path);
+    for (i = 0; i < count && len < SEARCHD_MAX_LINE; i++)
+        len += snprintf(line + len, SEARCHD_MAX_LINE - len, " %s", values[i]);
+    if (len >= SEARCHD_MAX_LINE - 1 || count > SEARCHD_MAX_VALUES) {
+        printf("Too many search values\n");
+        av_free(line);
+        return 1;
+    }
+    line[len++] = '\n';
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || !(f = fdopen(fd, "r+"))) {
+        printf("Could not connect to %s\n", socket_path);
+        if (fd >= 0)
+            close(fd);
+        av_free(line);
+        return 1;
+    }
+    if (fwrite(line, 1, len, f) != len || fflush(f) || shutdown(fd, SHUT_WR) < 0 ||
+        !fgets(line, SEARCHD_MAX_LINE, f)) {
+        printf("Could not query %s\n", socket_path);
+        res = 1;
+    } else if (!strncmp(line, "ERR ", 4)) {
+        int err = atoi(line + 4);
+        if (err == SEARCHD_ERR_MODE)
+            printf("Invalid search mode\n");
+        else if (err == SEARCHD_ERR_REQUEST)
+            printf("search value must be integer\n");
+        else if (err == SEARCHD_ERR_MEMORY)
+            printf("Daemon could not allocate memory\n");
+        else
+            print_load_error(err);
+        res = err == SEARCHD_ERR_MODE ? -4 : 0;
+    } else {
+        long long size;
+        int num;
+        if (sscanf(line, "OK %d %lld", &num, &size) == 2)
+            printf("Index size : %lld\n", size);
+        else
+            num = 0;
+        for (i = 0; i < num && fgets(line, SEARCHD_MAX_LINE, f); i++) {
+            Index read_idx, key_frame;
+            int n;
+            if (count > 1)
+                printf("%s :\n", values[i]);
+            if ((n = parse_index(line, &read_idx)) < 0 || parse_index(line + n, &key_frame) < 0) {
+                printf("Frame could not be found, check input data\n");
+                res = -2;
+                continue;
+            }
+            print_frame(read_idx, key_frame);
+        }
+        if (i < num) {
+            printf("Could not query %s\n", socket_path);
+            res = 1;
+        }
+    }
+    fclose(f);
+    av_free(line);
+    return res;
+}
+
+/*
+ * searches the value in several index files, the reels of a programme for example,
+ * only the files whose span holds it are opened
+ */
+static int search_catalog(uint64_t flags, char **files, int file_num, uint64_t search_val)
+{
+    SJ_IndexCatalog cat;
+    Index read_idx;
+    Index key_frame;
+    int res;
+    int i;
+
+    memset(&key_frame, 0, sizeof(key_frame));
+    memset(&read_idx, 0, sizeof(read_idx));
+    if (sj_index_catalog_init(&cat, 0, SJ_INDEX_LOAD_LAZY) < 0) {
+        printf("could not allocate memory\n");
+        return 1;
+    }
+    for (i = 0; i < file_num; i++) {
+        int load_res = sj_index_catalog_add(&cat, files[i]);
+        if (load_res < 0) {
+            printf("%s : ", files[i]);
+            print_load_error(load_res);
+            sj_index_catalog_close(&cat);
+            return 0;
+        }
+    }
+
+    res = sj_index_catalog_search(&cat, search_val, &read_idx, &key_frame, flags);
+    if (res == -4) {
+        printf("Invalid search mode\n");
+        res = -4;
+    } else if (res < 0) {
+        printf("Frame could not be found, check input data\n");
+        res = -2;
+    } else {
+        printf("Index file : %s\n", sj_index_catalog_filename(&cat, res));
+        print_frame(read_idx, key_frame);
+        res = 0;
+    }
+    sj_index_catalog_close(&cat);
+    return res;
+}
 
 int main(int argc, char **argv)
 {
@@ -11,37 +202,43 @@ int main(int argc, char **argv)
     Index read_idx;
     Index key_frame;
     uint64_t search_val;
+    const char *socket_path = NULL;
 
     memset(&key_frame, 0, sizeof(key_frame));
     memset(&read_idx, 0, sizeof(read_idx));
+    if (argc > 2 && !strcmp(argv[1], "-S")) {
+        socket_path = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
     if (argc < 4) {
-        printf("usage: search_idx <parameter type> <index file> <hhmmssff>\n");
+        printf("usage: search_idx <parameter type> <index file> [<index file> ...] <hhmmssff>\n");
+        printf("       search_idx -S <searchd socket> <parameter type> <index file> <hhmmssff> [<hhmmssff> ...]\n");
         printf("parameters types are :\n\t1\ttimecode\n\t2\tpts\n\t4\tdts\n");
         return 1;
     }
 
-    int len = strlen(argv[3]);
-    for (int i = 0; i < len; i++){
-        if (argv[3][i] < '0' || argv[3][i] > '9'){
-            printf("search value must be integer\n");
-            return 0;
+    for (int j = socket_path ? 3 : argc - 1; j < argc; j++) {
+        int len = strlen(argv[j]);
+        for (int i = 0; i < len; i++){
+            if (argv[j][i] < '0' || argv[j][i] > '9'){
+                printf("search value must be integer\n");
+                return 0;
+            }
         }
     }
 
-    // Index file loading and checks
-    int load_res = sj_index_load(argv[2], &sj_ic);
-    if (load_res == -1) {
-        printf("File could not be open\n");
-        return 0;
-    }
+    // the search is sent to the daemon that keeps the index loaded
+    if (socket_path)
+        return search_remote(socket_path, argv[1], argv[2], argv + 3, argc - 3);
+    // the files are parts of a single programme, the value is searched in the right one
+    if (argc > 4)
+        return search_catalog(atoll(argv[1]), argv + 2, argc - 3, atoll(argv[argc - 1]));
 
-    if (load_res == -2) {
-        printf("File is not a index file\n");
-        return 0;
-    }
-
-    if (load_res == -4) {
-        printf("Index is empty\n");
+    // Index file loading and checks, only the pages needed by the search are read
+    int load_res = sj_index_load2(argv[2], &sj_ic, SJ_INDEX_LOAD_LAZY);
+    if (load_res < 0) {
+        print_load_error(load_res);
         return 0;
     }
     printf("Index size : %lld\n", sj_ic.size);
@@ -62,8 +259,7 @@ int main(int argc, char **argv)
         return -4;
     }
 
-    printf("Frame %c : \t\ntimecode\t%02d:%02d:%02d:%02d\nPTS\t\t%lld\nDTS\t\t%lld\nPES-OFFSET\t\t%lld\n", sj_index_get_frame_type(read_idx) ,read_idx.timecode.hours, read_idx.timecode.minutes, read_idx.timecode.seconds, read_idx.timecode.frames, read_idx.pts, read_idx.dts, read_idx.pes_offset);
-    printf("Related key-frame : \t\ntimecode\t%02d:%02d:%02d:%02d\nPTS\t\t%lld\nDTS\t\t%lld\nPES-OFFSET\t\t%lld\n", key_frame.timecode.hours,key_frame.timecode.minutes, key_frame.timecode.seconds, key_frame.timecode.frames, key_frame.pts, key_frame.dts, key_frame.pes_offset);
+    print_frame(read_idx, key_frame);
     sj_index_unload(&sj_ic);
 
     return 0;
@@ -0,0 +1,532 @@
+/*
+ * searchd keeps the index files it is asked about loaded and answers searches on them
+ * over a Unix socket, see searchd.h for the protocol
+ *
+ */
+#define _XOPEN_SOURCE 700
+#include <ffmpeg/avformat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "libsjindex/indexer.h"
+#include "libsjindex/sj_search_index.h"
+#include "searchd.h"
+
+/// replies pending on a connection above which its requests are no longer read
+#define MAX_PENDING_OUTPUT (1 << 20)
+
+typedef struct CachedIndex {
+    char *filename;
+    SJ_IndexContext sj_ic;
+    struct timespec mtime;      ///< modification time, size and inode of the file when it was last read
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    size_t memory;              ///< sj_index_memory after the last request
+    struct CachedIndex *prev;   ///< more recently used
+    struct CachedIndex *next;   ///< less recently used
+} CachedIndex;
+
+/**
+ * Loaded indexes, most recently used first, the least recently used are unloaded
+ * when the memory they hold goes over max_memory
+ */
+typedef struct {
+    CachedIndex *first;
+    CachedIndex *last;
+    int num;
+    size_t memory;
+    size_t max_memory;
+    int flags;                  ///< sj_index_load2 flags
+    int64_t hits;
+    int64_t loads;
+    int64_t refreshes;
+    int64_t evictions;
+} IndexCache;
+
+typedef struct {
+    int fd;
+    char *in;                   ///< SEARCHD_MAX_LINE bytes, requests not handled yet
+    int in_len;
+    char *out;                  ///< replies not written yet
+    int out_len;
+    int out_size;
+    int out_pos;                ///< bytes of out already written
+    int eof;                    ///< no more requests, the connection is closed once the replies are written
+    int skip;                   ///< the request being received is too long, it is dropped up to its end
+    int error;
+} Client;
+
+typedef struct {
+    IndexCache cache;
+    Client *clients;
+    int client_num;
+    uint64_t values[SEARCHD_MAX_VALUES];
+    int frame_pos[SEARCHD_MAX_VALUES];
+    int key_frame_pos[SEARCHD_MAX_VALUES];
+} Server;
+
+static volatile sig_atomic_t quit;
+
+static void on_signal(int sig)
+{
+    quit = 1;
+}
+
+static void cache_unlink(IndexCache *cache, CachedIndex *c)
+{
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        cache->first = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    else
+        cache->last = c->prev;
+    c->prev = c->next = NULL;
+}
+
+static void cache_push(IndexCache *cache, CachedIndex *c)
+{
+    c->next = cache->first;
+    if (cache->first)
+        cache->first->prev = c;
+    else
+        cache->last = c;
+    cache->first = c;
+}
+
+static void cache_free(IndexCache *cache, CachedIndex *c)
+{
+    cache_unlink(cache, c);
+    cache->memory -= c->memory;
+    cache->num--;
+    sj_index_unload(&c->sj_ic);
+    av_free(c->filename);
+    av_free(c);
+}
+
+/*
+ * returns the loaded index of filename, loading it or reading it again if the file changed,
+ * or NULL and the sj_index_load2 error code in err
+ */
+static CachedIndex *cache_get(IndexCache *cache, const char *filename, int *err)
+{
+    CachedIndex *c;
+    struct stat st;
+    int ret;
+
+    for (c = cache->first; c && strcmp(c->filename, filename); c = c->next)
+        ;
+    if (stat(filename, &st) < 0) {
+        // a removed file is unloaded
+        if (c)
+            cache_free(cache, c);
+        *err = -1;
+        return NULL;
+    }
+    if (c) {
+        int modified = st.st_mtim.tv_sec != c->mtime.tv_sec || st.st_mtim.tv_nsec != c->mtime.tv_nsec;
+        cache_unlink(cache, c);
+        if (st.st_dev != c->dev || st.st_ino != c->ino || st.st_size < c->size || (modified && st.st_size == c->size)) {
+            // a file replaced, or rewritten without growing, is loaded again
+            sj_index_unload(&c->sj_ic);
+            ret = sj_index_load2(c->filename, &c->sj_ic, cache->flags);
+            cache->loads++;
+        } else if (st.st_size != c->size) {
+            // records appended by indexer -f are read without going over the others
+            ret = sj_index_refresh(&c->sj_ic);
+            cache->refreshes++;
+        } else {
+            ret = 0;
+            cache->hits++;
+        }
+        cache_push(cache, c);
+        if (ret < 0) {
+            cache_free(cache, c);
+            *err = ret;
+            return NULL;
+        }
+    } else {
+        c = av_mallocz(sizeof(*c));
+        if (!c || !(c->filename = av_strdup(filename))) {
+            av_free(c);
+            *err = SEARCHD_ERR_MEMORY;
+            return NULL;
+        }
+        ret = sj_index_load2(c->filename, &c->sj_ic, cache->flags);
+        if (ret < 0) {
+            av_free(c->filename);
+            av_free(c);
+            *err = ret;
+            return NULL;
+        }
+        cache_push(cache, c);
+        cache->num++;
+        cache->loads++;
+    }
+    c->mtime = st.st_mtim;
+    c->size = st.st_size;
+    c->dev = st.st_dev;
+    c->ino = st.st_ino;
+    return c;
+}
+
+// counts the structures built by the last searches of c, then unloads the least recently used indexes over the limit
+static void cache_trim(IndexCache *cache, CachedIndex *c)
+{
+    size_t memory = sj_index_memory(&c->sj_ic);
+
+    cache->memory += memory - c->memory;
+    c->memory = memory;
+    // the index just used is kept even if it alone goes over the limit
+    while (cache->memory > cache->max_memory && cache->last != c) {
+        cache_free(cache, cache->last);
+        cache->evictions++;
+    }
+}
+
+static void client_printf(Client *cl, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    if (cl->error)
+        return;
+    for (;;) {
+        va_start(ap, fmt);
+        len = vsnprintf(cl->out + cl->out_len, cl->out_size - cl->out_len, fmt, ap);
+        va_end(ap);
+        if (len < cl->out_size - cl->out_len)
+            break;
+        char *out = av_realloc(cl->out, FFMAX(2 * cl->out_size, cl->out_len + len + 1));
+        if (!out) {
+            cl->error = 1;
+            return;
+        }
+        cl->out = out;
+        cl->out_size = FFMAX(2 * cl->out_size, cl->out_len + len + 1);
+    }
+    cl->out_len += len;
+}
+
+static void print_index(Client *cl, const Index *idx)
+{
+    client_printf(cl, "%d %02d:%02d:%02d:%02d %lld %lld %lld", idx->pic_type,
+                  idx->timecode.hours, idx->timecode.minutes, idx->timecode.seconds, idx->timecode.frames,
+                  idx->pts, idx->dts, idx->pes_offset);
+}
+
+// parses a decimal value as search accepts it, returns -1 if it is not one
+static int parse_value(const char *s, uint64_t *value)
+{
+    const char *p;
+
+    if (!*s)
+        return -1;
+    for (p = s; *p; p++) {
+        if (*p < '0' || *p > '9')
+            return -1;
+    }
+    *value = strtoull(s, NULL, 10);
+    return 0;
+}
+
+static void handle_request(Server *s, Client *cl, char *line)
+{
+    char *save = NULL;
+    char *tok = strtok_r(line, " \t\r", &save);
+    char *filename;
+    CachedIndex *c;
+    uint64_t mode;
+    int count = 0;
+    int ret;
+    int i;
+
+    if (!tok)
+        return;
+    filename = strtok_r(NULL, " \t\r", &save);
+    if (parse_value(tok, &mode) < 0 || !filename) {
+        client_printf(cl, "ERR %d\n", SEARCHD_ERR_REQUEST);
+        return;
+    }
+    while ((tok = strtok_r(NULL, " \t\r", &save))) {
+        if (count == SEARCHD_MAX_VALUES || parse_value(tok, &s->values[count]) < 0) {
+            client_printf(cl, "ERR %d\n", SEARCHD_ERR_REQUEST);
+            return;
+        }
+        count++;
+    }
+    if (!count) {
+        client_printf(cl, "ERR %d\n", SEARCHD_ERR_REQUEST);
+        return;
+    }
+    if (mode != SJ_INDEX_TIMECODE_SEARCH && mode != SJ_INDEX_PTS_SEARCH && mode != SJ_INDEX_DTS_SEARCH) {
+        client_printf(cl, "ERR %d\n", SEARCHD_ERR_MODE);
+        return;
+    }
+
+    if (!(c = cache_get(&s->cache, filename, &ret))) {
+        client_printf(cl, "ERR %d\n", ret);
+        return;
+    }
+    ret = sj_index_search_batch(&c->sj_ic, s->values, count, s->frame_pos, s->key_frame_pos, mode);
+    if (ret < 0) {
+        client_printf(cl, "ERR %d\n", SEARCHD_ERR_MEMORY);
+    } else {
+        client_printf(cl, "OK %d %lld\n", count, c->sj_ic.size);
+        for (i = 0; i < count; i++) {
+            Index idx, key_frame;
+            if (sj_index_get(&c->sj_ic, s->frame_pos[i], &idx) < 0) {
+                client_printf(cl, "-\n");
+                continue;
+            }
+            // left empty for an I frame or if no I frame precedes the frame, as sj_index_search does
+            if (s->key_frame_pos[i] == s->frame_pos[i] ||
+                sj_index_get(&c->sj_ic, s->key_frame_pos[i], &key_frame) < 0)
+                memset(&key_frame, 0, sizeof(key_frame));
+            print_index(cl, &idx);
+            client_printf(cl, " ");
+            print_index(cl, &key_frame);
+            client_printf(cl, "\n");
+        }
+    }
+    cache_trim(&s->cache, c);
+}
+
+// answers the complete requests received, until enough replies are waiting to be written
+static void handle_requests(Server *s, Client *cl)
+{
+    char *line = cl->in;
+    char *end;
+
+    if (cl->skip) {
+        if (!(end = memchr(cl->in, '\n', cl->in_len))) {
+            cl->in_len = 0;
+            return;
+        }
+        line = end + 1;
+        cl->skip = 0;
+    }
+    while (!cl->error && cl->out_len - cl->out_pos < MAX_PENDING_OUTPUT &&
+           (end = memchr(line, '\n', cl->in + cl->in_len - line))) {
+        *end = 0;
+        handle_request(s, cl, line);
+        line = end + 1;
+    }
+    cl->in_len -= line - cl->in;
+    memmove(cl->in, line, cl->in_len);
+    if (cl->in_len == SEARCHD_MAX_LINE && !memchr(cl->in, '\n', cl->in_len)) {
+        client_printf(cl, "ERR %d\n", SEARCHD_ERR_REQUEST);
+        cl->in_len = 0;
+        cl->skip = 1;
+    }
+}
+
+static void client_read(Client *cl)
+{
+    ssize_t ret = read(cl->fd, cl->in + cl->in_len, SEARCHD_MAX_LINE - cl->in_len);
+
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            cl->error = 1;
+    } else if (!ret) {
+        cl->eof = 1;
+    } else {
+        cl->in_len += ret;
+    }
+}
+
+static void client_write(Client *cl)
+{
+    ssize_t ret = write(cl->fd, cl->out + cl->out_pos, cl->out_len - cl->out_pos);
+
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            cl->error = 1;
+        return;
+    }
+    cl->out_pos += ret;
+    if (cl->out_pos == cl->out_len)
+        cl->out_pos = cl->out_len = 0;
+}
+
+static void accept_clients(Server *s, int listen_fd)
+{
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        Client *clients;
+        Client *cl;
+
+        if (fd < 0)
+            return;
+        clients = av_realloc(s->clients, (s->client_num + 1) * sizeof(*clients));
+        if (!clients) {
+            close(fd);
+            return;
+        }
+        s->clients = clients;
+        cl = &s->clients[s->client_num];
+        memset(cl, 0, sizeof(*cl));
+        cl->fd = fd;
+        cl->in = av_malloc(SEARCHD_MAX_LINE);
+        if (!cl->in || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+            av_free(cl->in);
+            close(fd);
+            continue;
+        }
+        s->client_num++;
+    }
+}
+
+static void close_client(Server *s, int i)
+{
+    close(s->clients[i].fd);
+    av_free(s->clients[i].in);
+    av_free(s->clients[i].out);
+    s->clients[i] = s->clients[--s->client_num];
+}
+
+static int listen_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // the socket of a previous run, any other file is left alone
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0 ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int serve(Server *s, int listen_fd)
+{
+    struct pollfd *fds = NULL;
+    int i;
+
+    while (!quit) {
+        struct pollfd *tmp = av_realloc(fds, (s->client_num + 1) * sizeof(*fds));
+        if (!tmp)
+            break;
+        fds = tmp;
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (i = 0; i < s->client_num; i++) {
+            Client *cl = &s->clients[i];
+            fds[i + 1].fd = cl->fd;
+            fds[i + 1].events = 0;
+            if (!cl->eof && cl->out_len - cl->out_pos < MAX_PENDING_OUTPUT)
+                fds[i + 1].events |= POLLIN;
+            if (cl->out_len > cl->out_pos)
+                fds[i + 1].events |= POLLOUT;
+        }
+        if (poll(fds, s->client_num + 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        // connections accepted now are polled from the next round
+        for (i = s->client_num - 1; i >= 0; i--) {
+            Client *cl = &s->clients[i];
+            if (fds[i + 1].revents & POLLOUT)
+                client_write(cl);
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+                client_read(cl);
+            handle_requests(s, cl);
+            if (cl->error || (cl->eof && cl->out_len == cl->out_pos))
+                close_client(s, i);
+        }
+        if (fds[0].revents & POLLIN)
+            accept_clients(s, listen_fd);
+    }
+    av_free(fds);
+    return quit ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    Server *s;
+    int max_memory = 256;
+    int flags = 0;
+    int listen_fd;
+    int ret;
+    int i;
+
+    while ((i = getopt(argc, argv, "m:l:")) != -1) {
+        switch (i) {
+        case 'm':
+            max_memory = atoi(optarg);
+            break;
+        case 'l':
+            flags = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind < 1 || max_memory < 1 || flags < 0) {
+    usage:
+        printf("searchd [-m MiB] [-l flags] socket\n");
+        printf("answer the searches of search -S on the index files it keeps loaded\n");
+        printf("\t-m MiB\t\tmemory held by the loaded indexes, the least recently used are unloaded\n");
+        printf("\t\t\tabove it (default 256)\n");
+        printf("\t-l flags\tsj_index_load2 flags the indexes are loaded with: 1 mmap, 2 search tree,\n");
+        printf("\t\t\t4 lazy (default 0, read)\n");
+        return 1;
+    }
+
+    s = av_mallocz(sizeof(*s));
+    if (!s) {
+        printf("could not allocate memory\n");
+        return 1;
+    }
+    s->cache.max_memory = (size_t)max_memory << 20;
+    s->cache.flags = flags;
+    listen_fd = listen_socket(argv[optind]);
+    if (listen_fd < 0) {
+        printf("could not listen on %s: %s\n", argv[optind], strerror(errno));
+        av_free(s);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    ret = serve(s, listen_fd);
+    if (ret < 0)
+        printf("poll failed: %s\n", strerror(errno));
+    printf("loads %lld, refreshes %lld, hits %lld, evictions %lld\n",
+           s->cache.loads, s->cache.refreshes, s->cache.hits, s->cache.evictions);
+
+    close(listen_fd);
+    unlink(argv[optind]);
+    while (s->client_num)
+        close_client(s, s->client_num - 1);
+    while (s->cache.first)
+        cache_free(&s->cache, s->cache.first);
+    av_free(s->clients);
+    av_free(s);
+    return ret < 0;
+}
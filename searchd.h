@@ -0,0 +1,26 @@
+#ifndef SEARCHD_H
+#define SEARCHD_H
+
+/*
+ * searchd protocol, lines of text over a Unix stream socket
+ *
+ * request  "<mode> <index file> <value> [<value> ...]\n", mode and values as taken by sj_index_search,
+ *          the index file name is taken as is by the daemon, it should be an absolute path
+ * reply    "OK <count> <index file size>\n" followed by a line per value, in request order :
+ *          "<pic type> <hh:mm:ss:ff> <pts> <dts> <pes offset> <key frame pic type> <hh:mm:ss:ff> <pts> <dts> <pes offset>\n"
+ *          the key frame fields being zero for an I frame or if no I frame precedes the frame,
+ *          or "-\n" if the value was not found,
+ *          or "ERR <code>\n", code being a sj_index_load2 error code or one of the SEARCHD_ERR codes
+ *
+ * Requests can be sent without waiting for their replies, they are answered in order.
+ * Empty lines are ignored.
+ */
+
+#define SEARCHD_MAX_LINE 65536 ///< longest request, a longer one is answered with SEARCHD_ERR_REQUEST
+#define SEARCHD_MAX_VALUES 4096 ///< values per request
+
+#define SEARCHD_ERR_MODE -6 ///< invalid search mode
+#define SEARCHD_ERR_REQUEST -7 ///< malformed request
+#define SEARCHD_ERR_MEMORY -8 ///< memory could not be allocated
+
+#endif
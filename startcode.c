@@ -0,0 +1,110 @@
+/*
+ * startcode.c looks for 00 00 01 start code prefixes with SSE2 or AVX2 compares
+ * of 16 or 32 positions at once, the scanner is chosen at runtime from the CPU features
+ *
+ */
+#include <ffmpeg/avformat.h>
+
+#include "startcode.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_SIMD_SCAN 1
+#endif
+
+extern const uint8_t *ff_find_start_code(const uint8_t *p, const uint8_t *end, uint32_t *state);
+
+// first prefix at or after p, returned only if its code byte is in the buffer
+typedef const uint8_t *(*PrefixScan)(const uint8_t *p, const uint8_t *end);
+
+static const uint8_t *scan_prefix_c(const uint8_t *p, const uint8_t *end)
+{
+    for (; p + 3 < end; p++) {
+        if (p[2] > 1)
+            p += 2;
+        else if (!p[0] && !p[1] && p[2] == 1)
+            return p;
+    }
+    return end;
+}
+
+#ifdef HAVE_SIMD_SCAN
+/*
+ * the vectors at p, p + 1 and p + 2 are compared to 0, 0 and 1,
+ * a bit set in the combined mask is a prefix starting at that position
+ */
+__attribute__((target("sse2")))
+static const uint8_t *scan_prefix_sse2(const uint8_t *p, const uint8_t *end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+
+    for (; end - p >= 16 + 2; p += 16) {
+        __m128i v0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), zero);
+        __m128i v1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 1)), zero);
+        __m128i v2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 2)), one);
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(v0, v1), v2));
+        if (mask) {
+            p += __builtin_ctz(mask);
+            return p + 3 < end ? p : end;
+        }
+    }
+    return scan_prefix_c(p, end);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *scan_prefix_avx2(const uint8_t *p, const uint8_t *end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+
+    for (; end - p >= 32 + 2; p += 32) {
+        __m256i v0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), zero);
+        __m256i v1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 1)), zero);
+        __m256i v2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 2)), one);
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(v0, v1), v2));
+        if (mask) {
+            p += __builtin_ctz(mask);
+            return p + 3 < end ? p : end;
+        }
+    }
+    return scan_prefix_c(p, end);
+}
+#endif
+
+static PrefixScan scan_prefix;
+
+void start_code_init(void)
+{
+#ifdef HAVE_SIMD_SCAN
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan_prefix = scan_prefix_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        scan_prefix = scan_prefix_sse2;
+#endif
+}
+
+const uint8_t *find_start_code(const uint8_t *p, const uint8_t *end, uint32_t *state)
+{
+    const uint8_t *start = p;
+    int i;
+
+    if (!scan_prefix)
+        return ff_find_start_code(p, end, state);
+
+    if (p >= end)
+        return end;
+    // a start code begun in the previous buffer
+    for (i = 0; i < 3; i++) {
+        uint32_t tmp = *state << 8;
+        *state = tmp + *(p++);
+        if (tmp == 0x100 || p == end)
+            return p;
+    }
+    p = scan_prefix(start, end);
+    if (p == end)
+        p = end - 4;
+    *state = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    return p + 4;
+}
@@ -0,0 +1,16 @@
+#ifndef STARTCODE_H
+#define STARTCODE_H
+
+/**
+ * Selects the start code scanner for the running CPU, to be called once before find_start_code
+ */
+void start_code_init(void);
+
+/**
+ * Same contract as ff_find_start_code : returns the position following the first start code found
+ * in [p, end[ and sets state to its 4 bytes, or end with state holding the last 4 bytes read.
+ * state carries a start code split over two buffers from one call to the next.
+ */
+const uint8_t *find_start_code(const uint8_t *p, const uint8_t *end, uint32_t *state);
+
+#endif